@@ -1,11 +1,50 @@
+#include <algorithm>
 #include <chrono>
+#include <cstdio>
 #include <iostream>
 #include <vector>
 #include <random>
+#include <string>
+#include <tuple>
+#include <type_traits>
+#include <thread>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <fstream>
+#include <functional>
+#include <map>
+#include <mutex>
 #include <cassert>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <immintrin.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
 
+// Every kernel is built for several instruction sets inside this one binary. The loops that gain
+// from wider vectors are cloned by the compiler and resolved through cpuid when the program is
+// loaded, the hand-written microkernels are compiled per ISA and picked at startup by kernel_info().
+// The clones are keyed by ISA level (x86-64-v4: AVX-512, v3: AVX2 and FMA, v2: SSE4.2), which GCC checks
+// by CPU features; a clone for arch=<cpu> is only taken on that very CPU model.
+// The baseline variants multiply_v0 .. v3 are thin cloned wrappers around always-inline bodies, so
+// each clone gets the whole loop nest to vectorize without depending on being inlined into main().
+#define MULTIVERSION __attribute__((target_clones("arch=x86-64-v4", "arch=x86-64-v3", "arch=x86-64-v2", "default")))
+#define TARGET_AVX512 __attribute__((target("avx512f,avx512vl,avx512bw,avx512dq,fma")))
+#define TARGET_AVX2 __attribute__((target("avx2,fma")))
+#define TARGET_SSE __attribute__((target("sse4.2")))
+#define TARGET_F16C __attribute__((target("avx2,fma,f16c")))
+#define TARGET_AVX512_BF16 __attribute__((target("avx512f,avx512vl,avx512bw,avx512dq,avx512bf16,fma")))
+#define TARGET_AVX512_VNNI __attribute__((target("avx512f,avx512vl,avx512bw,avx512dq,avx512vnni,fma")))
 
-void multiply_v0_bT(const float* __restrict__ a, const float* __restrict__ bT, float* __restrict__ c, int M, int K, int N) {
+
+__attribute__((always_inline)) inline
+void multiply_v0_bT_body(const float* __restrict__ a, const float* __restrict__ bT, float* __restrict__ c, int M, int K,
+                         int N) {
     // c = a * bT
     for (int m = 0; m < M; m++) {
         for (int n = 0; n < N; n++) {
@@ -21,95 +60,4303 @@ void multiply_v0_bT(const float* __restrict__ a, const float* __restrict__ bT, f
     };
 }
 
-void multiply_v0_aT(const float* __restrict__ aT, const float* __restrict__ b, float* __restrict__ c, int M, int K, int N) {
-    // c = aT * b
+MULTIVERSION
+void multiply_v0_bT(const float* __restrict__ a, const float* __restrict__ bT, float* __restrict__ c, int M, int K, int N) {
+    multiply_v0_bT_body(a, bT, c, M, K, N);
+}
+
+__attribute__((always_inline)) inline
+void multiply_v0_aT_body(const float* __restrict__ aT, const float* __restrict__ b, float* __restrict__ c, int M, int K,
+                         int N) {
+    // c = aT * b
+    for (int m = 0; m < M; m++) {
+        for (int n = 0; n < N; n++) {
+            c[m * N + n] = 0.0;
+            for (int k = 0; k < K; k++) {
+                // c[m, n] += aT[k, m] * b[k, n]
+                // c[m, n] = c[m * N + n]
+                // aT[k, m] = aT[k * M + m]
+                // b[k, n] = b[k * N + n]
+                c[m * N + n] += aT[k * M + m] * b[k * N + n];
+            }
+        }
+    };
+}
+
+MULTIVERSION
+void multiply_v0_aT(const float* __restrict__ aT, const float* __restrict__ b, float* __restrict__ c, int M, int K, int N) {
+    multiply_v0_aT_body(aT, b, c, M, K, N);
+}
+
+__attribute__((always_inline)) inline
+void multiply_v1_aT_body(const float* __restrict__ aT, const float* __restrict__ b, float* __restrict__ c, int M, int K,
+                         int N) {
+    // c = aT * b, the second variant
+    for (int m = 0; m < M; m++) {
+        for (int n1 = 0; n1 < N; n1 += 16) {
+            // The strip of 16 is summed up in c over k, with the 16 columns innermost so that they are
+            // vectorized. A full tile keeps the constant trip count of 16, the fringe is shorter
+            if (N - n1 >= 16) {
+                for (int n2 = 0; n2 < 16; n2++) {
+                    c[m * N + n1 + n2] = 0.0;
+                }
+                for (int k = 0; k < K; k++) {
+                    for (int n2 = 0; n2 < 16; n2++) {
+                        c[m * N + n1 + n2] += aT[k * M + m] * b[k * N + n1 + n2];
+                    }
+                }
+            } else {
+                for (int n2 = 0; n2 < N - n1; n2++) {
+                    c[m * N + n1 + n2] = 0.0;
+                }
+                for (int k = 0; k < K; k++) {
+                    for (int n2 = 0; n2 < N - n1; n2++) {
+                        c[m * N + n1 + n2] += aT[k * M + m] * b[k * N + n1 + n2];
+                    }
+                }
+            }
+        }
+    };
+}
+
+MULTIVERSION
+void multiply_v1_aT(const float* __restrict__ aT, const float* __restrict__ b, float* __restrict__ c, int M, int K, int N) {
+    multiply_v1_aT_body(aT, b, c, M, K, N);
+}
+
+__attribute__((always_inline)) inline
+void multiply_v2_aT_body(const float* __restrict__ aT, const float* __restrict__ b, float* __restrict__ c, int M, int K, int N,
+                         float alpha, float beta) {
+    // c = alpha * aT * b + beta * c, the accelerated variant. Each row strip of 16 is summed up in a local
+    // accumulator and stored once, so c is neither zeroed beforehand nor read when beta = 0
+    for (int m = 0; m < M; m++) {
+        for (int n1 = 0; n1 < N; n1 += 16) {
+            // A full tile keeps the constant trip count of 16 that gets vectorized, the fringe is shorter.
+            // Each has its own accumulator, which keeps the full one in registers
+            int n2_end = std::min(16, N - n1);
+            if (n2_end == 16) {
+                float acc[16] = {};
+                for (int k = 0; k < K; k++) {
+                    for (int n2 = 0; n2 < 16; n2++) {
+                        acc[n2] += aT[k * M + m] * b[k * N + n1 + n2];
+                    }
+                }
+                for (int n2 = 0; n2 < 16; n2++) {
+                    float& cv = c[m * N + n1 + n2];
+                    cv = beta != 0.0f ? alpha * acc[n2] + beta * cv : alpha * acc[n2];
+                }
+            } else {
+                float acc[16] = {};
+                for (int k = 0; k < K; k++) {
+                    for (int n2 = 0; n2 < n2_end; n2++) {
+                        acc[n2] += aT[k * M + m] * b[k * N + n1 + n2];
+                    }
+                }
+                for (int n2 = 0; n2 < n2_end; n2++) {
+                    float& cv = c[m * N + n1 + n2];
+                    cv = beta != 0.0f ? alpha * acc[n2] + beta * cv : alpha * acc[n2];
+                }
+            }
+        }
+    };
+}
+
+MULTIVERSION
+void multiply_v2_aT(const float* __restrict__ aT, const float* __restrict__ b, float* __restrict__ c, int M, int K, int N,
+                    float alpha, float beta) {
+    multiply_v2_aT_body(aT, b, c, M, K, N, alpha, beta);
+}
+
+template <int MB, int NB, int KB>
+__attribute__((always_inline)) inline
+void multiply_tiled_body(const float* __restrict__ aT, const float* __restrict__ b, float* __restrict__ c, int M, int K, int N,
+                         float alpha, float beta) {
+    // c = alpha * aT * b + beta * c on MB x NB tiles of c, with K split into slabs of KB (KB = 0: no split).
+    // The slab loop is outermost, so one KB x N slab of b stays in cache while all tiles of c pass over it.
+    // Each tile is scaled by beta (or cleared without being read) by the first slab, right before it is
+    // accumulated into, instead of zeroing all of c in a separate pass; alpha is folded into the elements of aT
+    int kb = KB > 0 ? KB : std::max(K, 1);
+    int slabs = std::max(1, (K + kb - 1) / kb);
+    for (int s = 0; s < slabs; s++) {
+        int k1 = s * kb, k2 = std::min(K, k1 + kb);
+        for (int m1 = 0; m1 < M; m1 += MB) {
+            for (int n1 = 0; n1 < N; n1 += NB) {
+                // A full tile keeps the constant trip counts of MB and NB that get vectorized, the fringe is smaller
+                int m2_end = std::min(MB, M - m1), n2_end = std::min(NB, N - n1);
+                if (s == 0) {
+                    for (int m2 = 0; m2 < m2_end; m2++) {
+                        for (int n2 = 0; n2 < n2_end; n2++) {
+                            float& cv = c[(m1 + m2) * N + n1 + n2];
+                            cv = beta != 0.0f ? beta * cv : 0.0f;
+                        }
+                    }
+                }
+                for (int k = k1; k < k2; k++) {
+                    if (m2_end == MB && n2_end == NB) {
+                        for (int m2 = 0; m2 < MB; m2++) {
+                            for (int n2 = 0; n2 < NB; n2++) {
+                                c[(m1 + m2) * N + n1 + n2] += alpha * aT[k * M + m1 + m2] * b[k * N + n1 + n2];
+                            }
+                        }
+                    } else {
+                        for (int m2 = 0; m2 < m2_end; m2++) {
+                            for (int n2 = 0; n2 < n2_end; n2++) {
+                                c[(m1 + m2) * N + n1 + n2] += alpha * aT[k * M + m1 + m2] * b[k * N + n1 + n2];
+                            }
+                        }
+                    }
+                }
+            }
+        }
+    }
+}
+
+template <int MB, int NB, int KB>
+MULTIVERSION
+void multiply_tiled_aT(const float* __restrict__ aT, const float* __restrict__ b, float* __restrict__ c, int M, int K, int N,
+                       float alpha, float beta) {
+    // multiply_tiled_body cloned per ISA, for the variants swept and picked at runtime
+    multiply_tiled_body<MB, NB, KB>(aT, b, c, M, K, N, alpha, beta);
+}
+
+MULTIVERSION
+void multiply_v3_aT(const float* __restrict__ aT, const float* __restrict__ b, float* __restrict__ c, int M, int K, int N,
+                    float alpha, float beta) {
+    // c = alpha * aT * b + beta * c, the double-loop acceleration: 16 x 16 tiles without a K split
+    multiply_tiled_body<16, 16, 0>(aT, b, c, M, K, N, alpha, beta);
+}
+
+struct TiledVariant {
+    int mb;
+    int nb;
+    int kb;
+    void (*multiply)(const float* __restrict__ aT, const float* __restrict__ b, float* __restrict__ c, int M, int K, int N,
+                     float alpha, float beta);
+};
+
+// The instantiations of multiply_tiled_aT that can be swept and chosen from: the tiles of multiply_v3_aT and
+// of opt_gemm.py (bn = 16, 32), taller and wider ones, each without and with a K split
+const TiledVariant tiled_variants[] = {
+    { 16, 16, 0, multiply_tiled_aT<16, 16, 0> },    { 16, 32, 0, multiply_tiled_aT<16, 32, 0> },
+    { 32, 16, 0, multiply_tiled_aT<32, 16, 0> },    { 32, 32, 0, multiply_tiled_aT<32, 32, 0> },
+    { 8, 64, 0, multiply_tiled_aT<8, 64, 0> },      { 16, 16, 256, multiply_tiled_aT<16, 16, 256> },
+    { 16, 32, 256, multiply_tiled_aT<16, 32, 256> }, { 32, 16, 256, multiply_tiled_aT<32, 16, 256> },
+    { 32, 32, 256, multiply_tiled_aT<32, 32, 256> }, { 8, 64, 256, multiply_tiled_aT<8, 64, 256> },
+};
+constexpr int TILED_VARIANTS = sizeof(tiled_variants) / sizeof(tiled_variants[0]);
+
+template <class F>
+double time_ms(int reps, F&& f) {
+    // The mean wall time of reps calls of f, in ms, on the monotonic clock
+    auto total = 0.0;
+    for (int i = 0; i < reps; i++) {
+        std::chrono::time_point time_1 = std::chrono::steady_clock::now();
+        f();
+        std::chrono::time_point time_2 = std::chrono::steady_clock::now();
+        total += std::chrono::duration_cast<std::chrono::nanoseconds>(time_2 - time_1).count();
+    }
+    return total / reps * 1e-6;
+}
+
+const std::vector<double>& tiled_variant_times(int M, int K, int N) {
+    // Milliseconds of one run of each tiled variant on an M x K x N product, measured on scratch operands the
+    // first time a shape is asked for and remembered for the rest of the run
+    static std::mutex mutex;
+    static std::map<std::tuple<int, int, int>, std::vector<double>> memo;
+    std::lock_guard<std::mutex> lock(mutex);
+    std::vector<double>& times = memo[{ M, K, N }];
+    if (times.empty()) {
+        std::mt19937 gen(17);
+        std::uniform_real_distribution<> dis(-1.0, 1.0);
+        std::vector<float> aT(std::size_t(K) * M), b(std::size_t(K) * N), c(std::size_t(M) * N);
+        for (auto& v : aT) { v = dis(gen); }
+        for (auto& v : b) { v = dis(gen); }
+        for (const TiledVariant& variant : tiled_variants) {
+            times.push_back(time_ms(1, [&] { variant.multiply(aT.data(), b.data(), c.data(), M, K, N, 1.0f, 0.0f); }));
+        }
+    }
+    return times;
+}
+
+enum class Activation { none, relu, gelu };
+
+struct Epilogue {
+    // Work fused into the store of each tile of c after the last K slab, in this order:
+    // c = act(c + bias[n]) + residual[m * ldr + n], then tile_fn on the stored tile. The built-in
+    // steps run on the accumulator registers; null pointers and Activation::none skip a step
+    const float* bias = nullptr;
+    Activation act = Activation::none;
+    const float* residual = nullptr;
+    int ldr = 0;
+    // A user function over one mr x nr tile at rows m0.. and columns n0.. of c, see with_functor()
+    void (*tile_fn)(void* ctx, int m0, int n0, int mr, int nr, float* c, int ldc) = nullptr;
+    void* ctx = nullptr;
+};
+
+Epilogue shift_epilogue(const Epilogue& ep, int m, int n) {
+    // The built-in part of ep as seen from the tile whose top left corner is c[m, n]
+    Epilogue shifted = ep;
+    shifted.bias = ep.bias ? ep.bias + n : nullptr;
+    shifted.residual = ep.residual ? ep.residual + long(m) * ep.ldr + n : nullptr;
+    shifted.tile_fn = nullptr;
+    return shifted;
+}
+
+template <class F>
+Epilogue with_functor(Epilogue ep, F& f) {
+    // ep followed by the user's functor v = f(m, n, v) on every element of c. f is instantiated into the
+    // loop over a tile, so there is one indirect call per tile, made while that tile is still in L1.
+    // f is held by reference and must outlive the GEMM call
+    ep.ctx = static_cast<void*>(&f);
+    ep.tile_fn = [](void* ctx, int m0, int n0, int mr, int nr, float* c, int ldc) {
+        F& fn = *static_cast<F*>(ctx);
+        for (int i = 0; i < mr; i++) {
+            for (int j = 0; j < nr; j++) {
+                c[i * ldc + j] = fn(m0 + i, n0 + j, c[i * ldc + j]);
+            }
+        }
+    };
+    return ep;
+}
+
+float gelu(float x) {
+    // GELU in its tanh form, 0.5 x (1 + tanh(u)) with u = sqrt(2 / pi) (x + 0.044715 x^3), written as
+    // x * sigmoid(2u) like the vector versions
+    float u = 0.7978845608f * (x + 0.044715f * x * x * x);
+    return x / (1.0f + std::exp(-2.0f * u));
+}
+
+float epilogue_scalar(float v, const Epilogue& ep, int i, int j) {
+    // The built-in epilogue on element [i, j] of a tile
+    if (ep.bias) { v += ep.bias[j]; }
+    if (ep.act == Activation::relu) { v = std::max(v, 0.0f); }
+    if (ep.act == Activation::gelu) { v = gelu(v); }
+    if (ep.residual) { v += ep.residual[long(i) * ep.ldr + j]; }
+    return v;
+}
+
+// The vector exponentials follow Cephes expf: x = n ln2 + r with |r| <= ln2 / 2 (ln2 split into two parts
+// for precision), e^r by a degree 7 polynomial and 2^n built directly in the exponent bits. The input is
+// clamped to [-87, 88], where 2^n stays a normal float
+TARGET_AVX512
+inline __m512 exp_avx512(__m512 x) {
+    x = _mm512_min_ps(_mm512_max_ps(x, _mm512_set1_ps(-87.0f)), _mm512_set1_ps(88.0f));
+    __m512 n = _mm512_roundscale_ps(_mm512_mul_ps(x, _mm512_set1_ps(1.44269504f)),
+                                    _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+    __m512 r = _mm512_fnmadd_ps(n, _mm512_set1_ps(0.693359375f), x);
+    r = _mm512_fnmadd_ps(n, _mm512_set1_ps(-2.12194440e-4f), r);
+    __m512 p = _mm512_set1_ps(1.9875691500e-4f);
+    p = _mm512_fmadd_ps(p, r, _mm512_set1_ps(1.3981999507e-3f));
+    p = _mm512_fmadd_ps(p, r, _mm512_set1_ps(8.3334519073e-3f));
+    p = _mm512_fmadd_ps(p, r, _mm512_set1_ps(4.1665795894e-2f));
+    p = _mm512_fmadd_ps(p, r, _mm512_set1_ps(1.6666665459e-1f));
+    p = _mm512_fmadd_ps(p, r, _mm512_set1_ps(5.0000001201e-1f));
+    p = _mm512_fmadd_ps(p, _mm512_mul_ps(r, r), _mm512_add_ps(r, _mm512_set1_ps(1.0f)));
+    __m512i e = _mm512_slli_epi32(_mm512_add_epi32(_mm512_cvtps_epi32(n), _mm512_set1_epi32(127)), 23);
+    return _mm512_mul_ps(p, _mm512_castsi512_ps(e));
+}
+
+TARGET_AVX2
+inline __m256 exp_avx2(__m256 x) {
+    x = _mm256_min_ps(_mm256_max_ps(x, _mm256_set1_ps(-87.0f)), _mm256_set1_ps(88.0f));
+    __m256 n = _mm256_round_ps(_mm256_mul_ps(x, _mm256_set1_ps(1.44269504f)), _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+    __m256 r = _mm256_fnmadd_ps(n, _mm256_set1_ps(0.693359375f), x);
+    r = _mm256_fnmadd_ps(n, _mm256_set1_ps(-2.12194440e-4f), r);
+    __m256 p = _mm256_set1_ps(1.9875691500e-4f);
+    p = _mm256_fmadd_ps(p, r, _mm256_set1_ps(1.3981999507e-3f));
+    p = _mm256_fmadd_ps(p, r, _mm256_set1_ps(8.3334519073e-3f));
+    p = _mm256_fmadd_ps(p, r, _mm256_set1_ps(4.1665795894e-2f));
+    p = _mm256_fmadd_ps(p, r, _mm256_set1_ps(1.6666665459e-1f));
+    p = _mm256_fmadd_ps(p, r, _mm256_set1_ps(5.0000001201e-1f));
+    p = _mm256_fmadd_ps(p, _mm256_mul_ps(r, r), _mm256_add_ps(r, _mm256_set1_ps(1.0f)));
+    __m256i e = _mm256_slli_epi32(_mm256_add_epi32(_mm256_cvtps_epi32(n), _mm256_set1_epi32(127)), 23);
+    return _mm256_mul_ps(p, _mm256_castsi256_ps(e));
+}
+
+TARGET_SSE
+inline __m128 exp_sse(__m128 x) {
+    x = _mm_min_ps(_mm_max_ps(x, _mm_set1_ps(-87.0f)), _mm_set1_ps(88.0f));
+    __m128 n = _mm_round_ps(_mm_mul_ps(x, _mm_set1_ps(1.44269504f)), _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+    __m128 r = _mm_sub_ps(x, _mm_mul_ps(n, _mm_set1_ps(0.693359375f)));
+    r = _mm_sub_ps(r, _mm_mul_ps(n, _mm_set1_ps(-2.12194440e-4f)));
+    __m128 p = _mm_set1_ps(1.9875691500e-4f);
+    p = _mm_add_ps(_mm_mul_ps(p, r), _mm_set1_ps(1.3981999507e-3f));
+    p = _mm_add_ps(_mm_mul_ps(p, r), _mm_set1_ps(8.3334519073e-3f));
+    p = _mm_add_ps(_mm_mul_ps(p, r), _mm_set1_ps(4.1665795894e-2f));
+    p = _mm_add_ps(_mm_mul_ps(p, r), _mm_set1_ps(1.6666665459e-1f));
+    p = _mm_add_ps(_mm_mul_ps(p, r), _mm_set1_ps(5.0000001201e-1f));
+    p = _mm_add_ps(_mm_mul_ps(p, _mm_mul_ps(r, r)), _mm_add_ps(r, _mm_set1_ps(1.0f)));
+    __m128i e = _mm_slli_epi32(_mm_add_epi32(_mm_cvtps_epi32(n), _mm_set1_epi32(127)), 23);
+    return _mm_mul_ps(p, _mm_castsi128_ps(e));
+}
+
+TARGET_AVX512
+inline __m512 epilogue_avx512(__m512 v, const Epilogue& ep, int i, int j, __mmask16 mask) {
+    // The built-in epilogue on the columns j.. of row i of a tile, in a zmm register
+    if (ep.bias) { v = _mm512_add_ps(v, _mm512_maskz_loadu_ps(mask, ep.bias + j)); }
+    if (ep.act == Activation::relu) { v = _mm512_max_ps(v, _mm512_setzero_ps()); }
+    if (ep.act == Activation::gelu) {
+        __m512 u = _mm512_mul_ps(v, _mm512_fmadd_ps(_mm512_mul_ps(v, v), _mm512_set1_ps(0.7978845608f * 0.044715f),
+                                                    _mm512_set1_ps(0.7978845608f)));
+        __m512 e = exp_avx512(_mm512_mul_ps(u, _mm512_set1_ps(-2.0f)));
+        v = _mm512_div_ps(v, _mm512_add_ps(e, _mm512_set1_ps(1.0f)));
+    }
+    if (ep.residual) { v = _mm512_add_ps(v, _mm512_maskz_loadu_ps(mask, ep.residual + long(i) * ep.ldr + j)); }
+    return v;
+}
+
+template <bool MASKED>
+TARGET_AVX2
+inline __m256 epilogue_avx2(__m256 v, const Epilogue& ep, int i, int j, __m256i mask) {
+    // The built-in epilogue on the columns j.. of row i of a tile, in a ymm register
+    const float* residual = ep.residual ? ep.residual + long(i) * ep.ldr + j : nullptr;
+    if (ep.bias) { v = _mm256_add_ps(v, MASKED ? _mm256_maskload_ps(ep.bias + j, mask) : _mm256_loadu_ps(ep.bias + j)); }
+    if (ep.act == Activation::relu) { v = _mm256_max_ps(v, _mm256_setzero_ps()); }
+    if (ep.act == Activation::gelu) {
+        __m256 u = _mm256_mul_ps(v, _mm256_fmadd_ps(_mm256_mul_ps(v, v), _mm256_set1_ps(0.7978845608f * 0.044715f),
+                                                    _mm256_set1_ps(0.7978845608f)));
+        __m256 e = exp_avx2(_mm256_mul_ps(u, _mm256_set1_ps(-2.0f)));
+        v = _mm256_div_ps(v, _mm256_add_ps(e, _mm256_set1_ps(1.0f)));
+    }
+    if (residual) { v = _mm256_add_ps(v, MASKED ? _mm256_maskload_ps(residual, mask) : _mm256_loadu_ps(residual)); }
+    return v;
+}
+
+TARGET_SSE
+inline __m128 epilogue_sse(__m128 v, const Epilogue& ep, int i, int j) {
+    // The built-in epilogue on the columns j..j + 3 of row i of a tile, in an xmm register
+    if (ep.bias) { v = _mm_add_ps(v, _mm_loadu_ps(ep.bias + j)); }
+    if (ep.act == Activation::relu) { v = _mm_max_ps(v, _mm_setzero_ps()); }
+    if (ep.act == Activation::gelu) {
+        __m128 v2 = _mm_mul_ps(v, v);
+        __m128 u = _mm_mul_ps(v, _mm_add_ps(_mm_mul_ps(v2, _mm_set1_ps(0.7978845608f * 0.044715f)),
+                                            _mm_set1_ps(0.7978845608f)));
+        __m128 e = exp_sse(_mm_mul_ps(u, _mm_set1_ps(-2.0f)));
+        v = _mm_div_ps(v, _mm_add_ps(e, _mm_set1_ps(1.0f)));
+    }
+    if (ep.residual) { v = _mm_add_ps(v, _mm_loadu_ps(ep.residual + long(i) * ep.ldr + j)); }
+    return v;
+}
+
+// The microkernel computes c[0:mr, 0:nr] = a[0:mr, 0:K] * b[0:K, 0:nr] for one register-resident tile,
+// where a[m, k] = a[k * lda + m] (aT layout) and b[k, n] = b[k * ldb + n]. Fringe tiles at the right and
+// bottom edges of c pass mr and nr below the kernel's full tile size; nothing outside them is read or
+// written. The tile is stored as c = a * b + beta * c while still in registers: beta = 0 overwrites c
+// without reading it, beta = 1 sums up consecutive K slabs, and any other beta scales the old c for free.
+// A non-null ep, given relative to the tile (shift_epilogue), is applied to the registers before the store;
+// the epilogue is defined on floats, so the double kernels take none
+template <class T>
+using MicroKernelOf = void (*)(int K, const T* __restrict__ a, int lda, const T* __restrict__ b, int ldb,
+                               T* __restrict__ c, int ldc, int mr, int nr, T beta, const Epilogue* ep);
+using MicroKernel = MicroKernelOf<float>;
+
+enum class Isa { generic, sse, avx2, avx512 };
+
+template <class T>
+struct KernelInfoOf {
+    Isa isa;
+    const char* name;
+    int mr;
+    int nr;
+    MicroKernelOf<T> ukernel;
+};
+using KernelInfo = KernelInfoOf<float>;
+
+// SIMD traits: the register type of float or double on one instruction set and the operations the
+// microkernels are written in, so that each ISA has one microkernel for both element types. A register
+// holds lanes elements; Mask selects the leading lanes of a fringe column block
+template <class T, Isa ISA>
+struct Simd;
+
+template <>
+struct Simd<float, Isa::avx512> {
+    using Vec = __m512;
+    using Mask = __mmask16;
+    static constexpr int lanes = 16;
+    TARGET_AVX512 static Vec zero() { return _mm512_setzero_ps(); }
+    TARGET_AVX512 static Vec set1(float x) { return _mm512_set1_ps(x); }
+    TARGET_AVX512 static Vec broadcast(const float* p) { return _mm512_set1_ps(*p); }
+    TARGET_AVX512 static Vec load(Mask m, const float* p) { return _mm512_maskz_loadu_ps(m, p); }
+    TARGET_AVX512 static void store(float* p, Mask m, Vec v) { _mm512_mask_storeu_ps(p, m, v); }
+    TARGET_AVX512 static Vec fmadd(Vec a, Vec b, Vec c) { return _mm512_fmadd_ps(a, b, c); }
+};
+
+template <>
+struct Simd<double, Isa::avx512> {
+    using Vec = __m512d;
+    using Mask = __mmask8;
+    static constexpr int lanes = 8;
+    TARGET_AVX512 static Vec zero() { return _mm512_setzero_pd(); }
+    TARGET_AVX512 static Vec set1(double x) { return _mm512_set1_pd(x); }
+    TARGET_AVX512 static Vec broadcast(const double* p) { return _mm512_set1_pd(*p); }
+    TARGET_AVX512 static Vec load(Mask m, const double* p) { return _mm512_maskz_loadu_pd(m, p); }
+    TARGET_AVX512 static void store(double* p, Mask m, Vec v) { _mm512_mask_storeu_pd(p, m, v); }
+    TARGET_AVX512 static Vec fmadd(Vec a, Vec b, Vec c) { return _mm512_fmadd_pd(a, b, c); }
+};
+
+template <>
+struct Simd<float, Isa::avx2> {
+    using Vec = __m256;
+    using Mask = __m256i;
+    static constexpr int lanes = 8;
+    TARGET_AVX2 static Vec zero() { return _mm256_setzero_ps(); }
+    TARGET_AVX2 static Vec set1(float x) { return _mm256_set1_ps(x); }
+    TARGET_AVX2 static Vec broadcast(const float* p) { return _mm256_broadcast_ss(p); }
+    TARGET_AVX2 static Vec load(const float* p) { return _mm256_loadu_ps(p); }
+    TARGET_AVX2 static Vec load(Mask m, const float* p) { return _mm256_maskload_ps(p, m); }
+    TARGET_AVX2 static void store(float* p, Vec v) { _mm256_storeu_ps(p, v); }
+    TARGET_AVX2 static void store(float* p, Mask m, Vec v) { _mm256_maskstore_ps(p, m, v); }
+    TARGET_AVX2 static Vec fmadd(Vec a, Vec b, Vec c) { return _mm256_fmadd_ps(a, b, c); }
+    TARGET_AVX2 static Mask mask(int n) {
+        return _mm256_cmpgt_epi32(_mm256_set1_epi32(n), _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7));
+    }
+};
+
+template <>
+struct Simd<double, Isa::avx2> {
+    using Vec = __m256d;
+    using Mask = __m256i;
+    static constexpr int lanes = 4;
+    TARGET_AVX2 static Vec zero() { return _mm256_setzero_pd(); }
+    TARGET_AVX2 static Vec set1(double x) { return _mm256_set1_pd(x); }
+    TARGET_AVX2 static Vec broadcast(const double* p) { return _mm256_broadcast_sd(p); }
+    TARGET_AVX2 static Vec load(const double* p) { return _mm256_loadu_pd(p); }
+    TARGET_AVX2 static Vec load(Mask m, const double* p) { return _mm256_maskload_pd(p, m); }
+    TARGET_AVX2 static void store(double* p, Vec v) { _mm256_storeu_pd(p, v); }
+    TARGET_AVX2 static void store(double* p, Mask m, Vec v) { _mm256_maskstore_pd(p, m, v); }
+    TARGET_AVX2 static Vec fmadd(Vec a, Vec b, Vec c) { return _mm256_fmadd_pd(a, b, c); }
+    TARGET_AVX2 static Mask mask(int n) { return _mm256_cmpgt_epi64(_mm256_set1_epi64x(n), _mm256_setr_epi64x(0, 1, 2, 3)); }
+};
+
+template <>
+struct Simd<float, Isa::sse> {
+    using Vec = __m128;
+    static constexpr int lanes = 4;
+    TARGET_SSE static Vec zero() { return _mm_setzero_ps(); }
+    TARGET_SSE static Vec set1(float x) { return _mm_set1_ps(x); }
+    TARGET_SSE static Vec broadcast(const float* p) { return _mm_set1_ps(*p); }
+    TARGET_SSE static Vec load(const float* p) { return _mm_loadu_ps(p); }
+    TARGET_SSE static void store(float* p, Vec v) { _mm_storeu_ps(p, v); }
+    // No FMA before AVX2, so mul + add
+    TARGET_SSE static Vec fmadd(Vec a, Vec b, Vec c) { return _mm_add_ps(c, _mm_mul_ps(a, b)); }
+};
+
+template <>
+struct Simd<double, Isa::sse> {
+    using Vec = __m128d;
+    static constexpr int lanes = 2;
+    TARGET_SSE static Vec zero() { return _mm_setzero_pd(); }
+    TARGET_SSE static Vec set1(double x) { return _mm_set1_pd(x); }
+    TARGET_SSE static Vec broadcast(const double* p) { return _mm_set1_pd(*p); }
+    TARGET_SSE static Vec load(const double* p) { return _mm_loadu_pd(p); }
+    TARGET_SSE static void store(double* p, Vec v) { _mm_storeu_pd(p, v); }
+    TARGET_SSE static Vec fmadd(Vec a, Vec b, Vec c) { return _mm_add_pd(c, _mm_mul_pd(a, b)); }
+};
+
+template <class T, int ROWS>
+TARGET_AVX512
+void micro_tile_avx512(int K, const T* __restrict__ a, int lda, const T* __restrict__ b, int ldb, T* __restrict__ c,
+                       int ldc, typename Simd<T, Isa::avx512>::Mask mask0, typename Simd<T, Isa::avx512>::Mask mask1,
+                       T beta, const Epilogue* ep) {
+    // ROWS x 2 registers of c in zmm accumulators; the columns switched off in mask0/mask1 are never touched
+    using S = Simd<T, Isa::avx512>;
+    constexpr int L = S::lanes;
+    typename S::Vec acc[ROWS][2];
+#pragma GCC unroll 8
+    for (int i = 0; i < ROWS; i++) {
+        acc[i][0] = S::zero();
+        acc[i][1] = S::zero();
+    }
+
+    for (int k = 0; k < K; k++) {
+        // One row of b is loaded once and reused by all broadcasts of a
+        typename S::Vec b0 = S::load(mask0, b + long(k) * ldb);
+        typename S::Vec b1 = S::load(mask1, b + long(k) * ldb + L);
+#pragma GCC unroll 8
+        for (int i = 0; i < ROWS; i++) {
+            typename S::Vec ai = S::broadcast(a + long(k) * lda + i);
+            acc[i][0] = S::fmadd(ai, b0, acc[i][0]);
+            acc[i][1] = S::fmadd(ai, b1, acc[i][1]);
+        }
+    }
+
+    typename S::Vec vbeta = S::set1(beta);
+#pragma GCC unroll 8
+    for (int i = 0; i < ROWS; i++) {
+        if (beta != T(0)) {
+            acc[i][0] = S::fmadd(vbeta, S::load(mask0, c + i * ldc), acc[i][0]);
+            acc[i][1] = S::fmadd(vbeta, S::load(mask1, c + i * ldc + L), acc[i][1]);
+        }
+        if constexpr (std::is_same_v<T, float>) {
+            if (ep) {
+                acc[i][0] = epilogue_avx512(acc[i][0], *ep, i, 0, mask0);
+                acc[i][1] = epilogue_avx512(acc[i][1], *ep, i, L, mask1);
+            }
+        }
+        S::store(c + i * ldc, mask0, acc[i][0]);
+        S::store(c + i * ldc + L, mask1, acc[i][1]);
+    }
+}
+
+template <class T>
+TARGET_AVX512
+void micro_kernel_avx512(int K, const T* __restrict__ a, int lda, const T* __restrict__ b, int ldb, T* __restrict__ c,
+                         int ldc, int mr, int nr, T beta, const Epilogue* ep) {
+    // An 8 x 32 tile of floats (8 x 16 of doubles) is held in 16 zmm accumulators. Fringe rows select a shorter
+    // instantiation, fringe columns are masked off in the k-mask registers of every load and store
+    using S = Simd<T, Isa::avx512>;
+    using Tile = decltype(&micro_tile_avx512<T, 8>);
+    static const Tile tiles[] = { nullptr, micro_tile_avx512<T, 1>, micro_tile_avx512<T, 2>, micro_tile_avx512<T, 3>,
+                                  micro_tile_avx512<T, 4>, micro_tile_avx512<T, 5>, micro_tile_avx512<T, 6>,
+                                  micro_tile_avx512<T, 7>, micro_tile_avx512<T, 8> };
+    auto mask = [](int n) { return typename S::Mask((1u << std::clamp(n, 0, S::lanes)) - 1); };
+    tiles[mr](K, a, lda, b, ldb, c, ldc, mask(nr), mask(nr - S::lanes), beta, ep);
+}
+
+template <class T, int ROWS, bool MASKED>
+TARGET_AVX2
+void micro_tile_avx2(int K, const T* __restrict__ a, int lda, const T* __restrict__ b, int ldb, T* __restrict__ c,
+                     int ldc, __m256i mask0, __m256i mask1, T beta, const Epilogue* ep) {
+    // ROWS x 2 registers of c in ymm accumulators; a MASKED tile goes through vmaskmov for the columns
+    using S = Simd<T, Isa::avx2>;
+    constexpr int L = S::lanes;
+    typename S::Vec acc[ROWS][2];
+#pragma GCC unroll 6
+    for (int i = 0; i < ROWS; i++) {
+        acc[i][0] = S::zero();
+        acc[i][1] = S::zero();
+    }
+
+    for (int k = 0; k < K; k++) {
+        typename S::Vec b0, b1;
+        if constexpr (MASKED) {
+            b0 = S::load(mask0, b + long(k) * ldb);
+            b1 = S::load(mask1, b + long(k) * ldb + L);
+        } else {
+            b0 = S::load(b + long(k) * ldb);
+            b1 = S::load(b + long(k) * ldb + L);
+        }
+#pragma GCC unroll 6
+        for (int i = 0; i < ROWS; i++) {
+            typename S::Vec ai = S::broadcast(a + long(k) * lda + i);
+            acc[i][0] = S::fmadd(ai, b0, acc[i][0]);
+            acc[i][1] = S::fmadd(ai, b1, acc[i][1]);
+        }
+    }
+
+    typename S::Vec vbeta = S::set1(beta);
+#pragma GCC unroll 6
+    for (int i = 0; i < ROWS; i++) {
+        if constexpr (MASKED) {
+            if (beta != T(0)) {
+                acc[i][0] = S::fmadd(vbeta, S::load(mask0, c + i * ldc), acc[i][0]);
+                acc[i][1] = S::fmadd(vbeta, S::load(mask1, c + i * ldc + L), acc[i][1]);
+            }
+        } else {
+            if (beta != T(0)) {
+                acc[i][0] = S::fmadd(vbeta, S::load(c + i * ldc), acc[i][0]);
+                acc[i][1] = S::fmadd(vbeta, S::load(c + i * ldc + L), acc[i][1]);
+            }
+        }
+        if constexpr (std::is_same_v<T, float>) {
+            if (ep) {
+                acc[i][0] = epilogue_avx2<MASKED>(acc[i][0], *ep, i, 0, mask0);
+                acc[i][1] = epilogue_avx2<MASKED>(acc[i][1], *ep, i, L, mask1);
+            }
+        }
+        if constexpr (MASKED) {
+            S::store(c + i * ldc, mask0, acc[i][0]);
+            S::store(c + i * ldc + L, mask1, acc[i][1]);
+        } else {
+            S::store(c + i * ldc, acc[i][0]);
+            S::store(c + i * ldc + L, acc[i][1]);
+        }
+    }
+}
+
+template <class T>
+TARGET_AVX2
+void micro_kernel_avx2(int K, const T* __restrict__ a, int lda, const T* __restrict__ b, int ldb, T* __restrict__ c,
+                       int ldc, int mr, int nr, T beta, const Epilogue* ep) {
+    // A 6 x 16 tile of floats (6 x 8 of doubles) is held in 12 ymm accumulators. AVX2 has no mask registers,
+    // so fringe columns use lane masks built by comparing the column index with nr
+    using S = Simd<T, Isa::avx2>;
+    using Tile = decltype(&micro_tile_avx2<T, 6, false>);
+    static const Tile full[] = { nullptr, micro_tile_avx2<T, 1, false>, micro_tile_avx2<T, 2, false>,
+                                 micro_tile_avx2<T, 3, false>, micro_tile_avx2<T, 4, false>, micro_tile_avx2<T, 5, false>,
+                                 micro_tile_avx2<T, 6, false> };
+    static const Tile masked[] = { nullptr, micro_tile_avx2<T, 1, true>, micro_tile_avx2<T, 2, true>,
+                                   micro_tile_avx2<T, 3, true>, micro_tile_avx2<T, 4, true>, micro_tile_avx2<T, 5, true>,
+                                   micro_tile_avx2<T, 6, true> };
+    (nr == 2 * S::lanes ? full : masked)[mr](K, a, lda, b, ldb, c, ldc, S::mask(nr), S::mask(nr - S::lanes), beta, ep);
+}
+
+template <class T>
+void micro_kernel_generic(int K, const T* __restrict__ a, int lda, const T* __restrict__ b, int ldb, T* __restrict__ c,
+                          int ldc, int mr, int nr, T beta, const Epilogue* ep) {
+    // A 4 x 4 tile of c in plain C++, for CPUs without any of the above
+    constexpr int MR = 4, NR = 4;
+    T acc[MR][NR] = {};
+    for (int k = 0; k < K; k++) {
+        for (int i = 0; i < mr; i++) {
+            for (int j = 0; j < nr; j++) {
+                acc[i][j] += a[long(k) * lda + i] * b[long(k) * ldb + j];
+            }
+        }
+    }
+    for (int i = 0; i < mr; i++) {
+        for (int j = 0; j < nr; j++) {
+            T v = beta != T(0) ? beta * c[i * ldc + j] + acc[i][j] : acc[i][j];
+            if constexpr (std::is_same_v<T, float>) {
+                if (ep) { v = epilogue_scalar(v, *ep, i, j); }
+            }
+            c[i * ldc + j] = v;
+        }
+    }
+}
+
+template <class T>
+TARGET_SSE
+void micro_kernel_sse(int K, const T* __restrict__ a, int lda, const T* __restrict__ b, int ldb, T* __restrict__ c,
+                      int ldc, int mr, int nr, T beta, const Epilogue* ep) {
+    // A 4 x 8 tile of floats (4 x 4 of doubles) is held in 8 xmm accumulators. SSE has no masked loads and
+    // stores, so the rare fringe tiles take the scalar path
+    using S = Simd<T, Isa::sse>;
+    constexpr int MR = 4, L = S::lanes, NR = 2 * L;
+    if (mr != MR || nr != NR) {
+        for (int j = 0; j < nr; j += 4) {
+            Epilogue ep_j = ep ? shift_epilogue(*ep, 0, j) : Epilogue();
+            micro_kernel_generic(K, a, lda, b + j, ldb, c + j, ldc, mr, std::min(4, nr - j), beta, ep ? &ep_j : nullptr);
+        }
+        return;
+    }
+    typename S::Vec acc[MR][2];
+#pragma GCC unroll 4
+    for (int i = 0; i < MR; i++) {
+        acc[i][0] = S::zero();
+        acc[i][1] = S::zero();
+    }
+
+    for (int k = 0; k < K; k++) {
+        typename S::Vec b0 = S::load(b + long(k) * ldb);
+        typename S::Vec b1 = S::load(b + long(k) * ldb + L);
+#pragma GCC unroll 4
+        for (int i = 0; i < MR; i++) {
+            typename S::Vec ai = S::broadcast(a + long(k) * lda + i);
+            acc[i][0] = S::fmadd(ai, b0, acc[i][0]);
+            acc[i][1] = S::fmadd(ai, b1, acc[i][1]);
+        }
+    }
+
+    typename S::Vec vbeta = S::set1(beta);
+#pragma GCC unroll 4
+    for (int i = 0; i < MR; i++) {
+        if (beta != T(0)) {
+            acc[i][0] = S::fmadd(vbeta, S::load(c + i * ldc), acc[i][0]);
+            acc[i][1] = S::fmadd(vbeta, S::load(c + i * ldc + L), acc[i][1]);
+        }
+        if constexpr (std::is_same_v<T, float>) {
+            if (ep) {
+                acc[i][0] = epilogue_sse(acc[i][0], *ep, i, 0);
+                acc[i][1] = epilogue_sse(acc[i][1], *ep, i, 4);
+            }
+        }
+        S::store(c + i * ldc, acc[i][0]);
+        S::store(c + i * ldc + L, acc[i][1]);
+    }
+}
+
+const char* isa_name(Isa isa) {
+    switch (isa) {
+        case Isa::avx512: return "avx512";
+        case Isa::avx2: return "avx2";
+        case Isa::sse: return "sse";
+        default: return "generic";
+    }
+}
+
+Isa detect_isa() {
+    // The best instruction set supported by this CPU according to cpuid. The environment variable
+    // TVM_LEARN_ISA (avx512, avx2, sse, generic) may lower the choice, e.g. to compare the kernels
+    __builtin_cpu_init();
+    Isa isa = Isa::generic;
+    if (__builtin_cpu_supports("sse4.2")) { isa = Isa::sse; }
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) { isa = Isa::avx2; }
+    if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512vl") &&
+        __builtin_cpu_supports("avx512bw") && __builtin_cpu_supports("avx512dq")) { isa = Isa::avx512; }
+
+    if (const char* env = std::getenv("TVM_LEARN_ISA")) {
+        for (Isa requested : { Isa::generic, Isa::sse, Isa::avx2, Isa::avx512 }) {
+            if (std::strcmp(env, isa_name(requested)) == 0 && requested < isa) {
+                isa = requested;
+            }
+        }
+    }
+    return isa;
+}
+
+template <class T = float>
+const KernelInfoOf<T>& kernel_info() {
+    // The microkernel for this CPU and element type, selected once at startup. The SIMD tiles are two
+    // registers wide, so they hold half as many columns of doubles as of floats
+    static const KernelInfoOf<T> info = [] {
+        switch (detect_isa()) {
+            case Isa::avx512:
+                return KernelInfoOf<T>{ Isa::avx512, "avx512", 8, 2 * Simd<T, Isa::avx512>::lanes, micro_kernel_avx512<T> };
+            case Isa::avx2:
+                return KernelInfoOf<T>{ Isa::avx2, "avx2", 6, 2 * Simd<T, Isa::avx2>::lanes, micro_kernel_avx2<T> };
+            case Isa::sse: return KernelInfoOf<T>{ Isa::sse, "sse", 4, 2 * Simd<T, Isa::sse>::lanes, micro_kernel_sse<T> };
+            default: return KernelInfoOf<T>{ Isa::generic, "generic", 4, 4, micro_kernel_generic<T> };
+        }
+    }();
+    return info;
+}
+
+void multiply_v4_aT(const float* __restrict__ aT, const float* __restrict__ b, float* __restrict__ c, int M, int K, int N) {
+    // c = aT * b, the register-blocked microkernel of the best available ISA
+    const KernelInfo& ki = kernel_info();
+    for (int m1 = 0; m1 < M; m1 += ki.mr) {
+        for (int n1 = 0; n1 < N; n1 += ki.nr) {
+            ki.ukernel(K, aT + m1, M, b + n1, N, c + long(m1) * N + n1, N, std::min(ki.mr, M - m1), std::min(ki.nr, N - n1), 0.0f, nullptr);
+        }
+    }
+}
+
+struct BlockSizes {
+    // Cache blocking of the five-loop GEMM: an mc x kc block of a stays in L2,
+    // a kc x nc panel of b stays in L3, and a kc x nr sliver of b stays in L1
+    int mc;
+    int kc;
+    int nc;
+};
+
+template <class T>
+BlockSizes default_block_sizes(const KernelInfoOf<T>& ki) {
+    // Block sizes derived from the cache sizes of this machine, rounded to whole register tiles.
+    // The environment variable TVM_LEARN_BLOCKS="mc,kc,nc" overrides them
+    long l1 = sysconf(_SC_LEVEL1_DCACHE_SIZE);
+    long l2 = sysconf(_SC_LEVEL2_CACHE_SIZE);
+    long l3 = sysconf(_SC_LEVEL3_CACHE_SIZE);
+    if (l1 <= 0) { l1 = 32 * 1024; }
+    if (l2 <= 0) { l2 = 1024 * 1024; }
+    if (l3 <= 0) { l3 = 8 * 1024 * 1024; }
+
+    BlockSizes bs;
+    // The mr x kc strip of a and the kc x nr sliver of b share three quarters of L1
+    bs.kc = std::max(16, int(l1 * 3 / 4 / (sizeof(T) * (ki.mr + ki.nr))) / 16 * 16);
+    // The mc x kc block of a takes half of L2
+    bs.mc = std::max(ki.mr, int(l2 / 2 / (sizeof(T) * bs.kc)) / ki.mr * ki.mr);
+    // The kc x nc panel of b takes half of L3, capped to keep very large caches reasonable
+    bs.nc = std::max(ki.nr, int(std::min(l3 / 2 / long(sizeof(T) * bs.kc), 8192L)) / ki.nr * ki.nr);
+
+    if (const char* env = std::getenv("TVM_LEARN_BLOCKS")) {
+        BlockSizes user;
+        if (std::sscanf(env, "%d,%d,%d", &user.mc, &user.kc, &user.nc) == 3 &&
+            user.mc > 0 && user.mc % ki.mr == 0 && user.kc > 0 && user.nc > 0 && user.nc % ki.nr == 0) {
+            bs = user;
+        } else {
+            std::cerr << "Ignoring TVM_LEARN_BLOCKS=" << env << ": expected mc,kc,nc with mc % " << ki.mr
+                      << " == 0 and nc % " << ki.nr << " == 0" << std::endl;
+        }
+    }
+    return bs;
+}
+
+MULTIVERSION
+void scale_matrix(int M, int N, float beta, float* __restrict__ C, int ldc) {
+    // C = beta * C; beta = 0 clears C without reading it, as BLAS does, so NaNs in C do not survive
+    for (int m = 0; m < M; m++) {
+        for (int n = 0; n < N; n++) {
+            C[long(m) * ldc + n] = beta == 0.0f ? 0.0f : beta * C[long(m) * ldc + n];
+        }
+    }
+}
+
+void multiply_v5_aT(const float* __restrict__ aT, const float* __restrict__ b, float* __restrict__ c, int M, int K, int N,
+                    const BlockSizes& bs) {
+    // c = aT * b, five loops around the microkernel: N is split into L3 panels of nc columns,
+    // K into L2 slabs of kc, M into blocks of mc rows, and those into nr x mr register tiles
+    const KernelInfo& ki = kernel_info();
+    assert(bs.mc % ki.mr == 0 && bs.nc % ki.nr == 0);
+    // Without K slabs no microkernel stores c, which is the zero product
+    if (K <= 0) {
+        scale_matrix(M, N, 0.0f, c, N);
+        return;
+    }
+    for (int jc = 0; jc < N; jc += bs.nc) {
+        int nc = std::min(bs.nc, N - jc);
+        for (int pc = 0; pc < K; pc += bs.kc) {
+            int kc = std::min(bs.kc, K - pc);
+            for (int ic = 0; ic < M; ic += bs.mc) {
+                int mc = std::min(bs.mc, M - ic);
+                for (int jr = 0; jr < nc; jr += ki.nr) {
+                    for (int ir = 0; ir < mc; ir += ki.mr) {
+                        // The first K slab overwrites c, the following ones accumulate into it
+                        ki.ukernel(kc, aT + long(pc) * M + ic + ir, M, b + long(pc) * N + jc + jr, N,
+                                   c + long(ic + ir) * N + jc + jr, N, std::min(ki.mr, mc - ir), std::min(ki.nr, nc - jr),
+                                   pc > 0 ? 1.0f : 0.0f, nullptr);
+                    }
+                }
+            }
+        }
+    }
+}
+
+template <class T>
+struct AlignedAllocator {
+    // Allocator for std::vector that places the buffer on a cache line boundary
+    using value_type = T;
+    static constexpr std::size_t alignment = 64;
+
+    AlignedAllocator() = default;
+    template <class U>
+    AlignedAllocator(const AlignedAllocator<U>&) {}
+
+    T* allocate(std::size_t n) {
+        std::size_t bytes = (n * sizeof(T) + alignment - 1) / alignment * alignment;
+        void* p = std::aligned_alloc(alignment, bytes);
+        if (!p) { throw std::bad_alloc(); }
+        return static_cast<T*>(p);
+    }
+    void deallocate(T* p, std::size_t) { std::free(p); }
+
+    template <class U>
+    bool operator==(const AlignedAllocator<U>&) const { return true; }
+    template <class U>
+    bool operator!=(const AlignedAllocator<U>&) const { return false; }
+};
+
+using aligned_vector = std::vector<float, AlignedAllocator<float>>;
+
+int num_threads() {
+    // Number of worker threads: TVM_LEARN_THREADS if set, otherwise one per hardware thread
+    static const int n = [] {
+        if (const char* env = std::getenv("TVM_LEARN_THREADS")) {
+            int requested = std::atoi(env);
+            if (requested > 0) { return requested; }
+        }
+        return std::max(1, int(std::thread::hardware_concurrency()));
+    }();
+    return n;
+}
+
+struct NumaTopology {
+    // The CPUs this process may run on, grouped by NUMA node
+    std::vector<std::vector<int>> node_cpus;
+    bool simulated = false;
+
+    int nodes() const { return int(node_cpus.size()); }
+};
+
+std::vector<int> parse_cpulist(const std::string& list) {
+    // Parses a kernel CPU list such as "0-3,8-11"
+    std::vector<int> cpus;
+    std::size_t pos = 0;
+    while (pos < list.size()) {
+        int first = 0, last = 0, consumed = 0;
+        if (std::sscanf(list.c_str() + pos, "%d-%d%n", &first, &last, &consumed) == 2) {
+            for (int cpu = first; cpu <= last; cpu++) { cpus.push_back(cpu); }
+        } else if (std::sscanf(list.c_str() + pos, "%d%n", &first, &consumed) == 1) {
+            cpus.push_back(first);
+        } else {
+            break;
+        }
+        pos += consumed + 1;
+    }
+    return cpus;
+}
+
+const NumaTopology& numa_topology() {
+    // The NUMA nodes of this machine as listed in /sys/devices/system/node. TVM_LEARN_NUMA_NODES=n
+    // simulates n nodes by splitting the CPUs into n groups (sharing CPUs if there are fewer than n),
+    // so the NUMA code paths can be exercised on a single-node machine
+    static const NumaTopology topology = [] {
+        std::vector<int> allowed;
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+            for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+                if (CPU_ISSET(cpu, &set)) { allowed.push_back(cpu); }
+            }
+        }
+        if (allowed.empty()) { allowed.push_back(0); }
+
+        NumaTopology t;
+        if (const char* env = std::getenv("TVM_LEARN_NUMA_NODES")) {
+            int nodes = std::atoi(env);
+            if (nodes > 0) {
+                t.simulated = true;
+                int cpus = int(allowed.size());
+                for (int d = 0; d < nodes; d++) {
+                    std::vector<int> group;
+                    for (int i = cpus * d / nodes; i < cpus * (d + 1) / nodes; i++) { group.push_back(allowed[i]); }
+                    if (group.empty()) { group.push_back(allowed[d % cpus]); }
+                    t.node_cpus.push_back(group);
+                }
+                return t;
+            }
+        }
+
+        std::vector<int> node_ids;
+        if (DIR* dir = opendir("/sys/devices/system/node")) {
+            while (dirent* entry = readdir(dir)) {
+                int id;
+                char tail;
+                if (std::sscanf(entry->d_name, "node%d%c", &id, &tail) == 1) { node_ids.push_back(id); }
+            }
+            closedir(dir);
+        }
+        std::sort(node_ids.begin(), node_ids.end());
+        for (int id : node_ids) {
+            std::ifstream file("/sys/devices/system/node/node" + std::to_string(id) + "/cpulist");
+            std::string list;
+            std::getline(file, list);
+            std::vector<int> cpus;
+            for (int cpu : parse_cpulist(list)) {
+                if (std::find(allowed.begin(), allowed.end(), cpu) != allowed.end()) { cpus.push_back(cpu); }
+            }
+            if (!cpus.empty()) { t.node_cpus.push_back(cpus); }
+        }
+        if (t.node_cpus.empty()) { t.node_cpus.push_back(allowed); }
+        return t;
+    }();
+    return topology;
+}
+
+bool pin_thread(pthread_t thread, const std::vector<int>& cpus) {
+    // Restricts a thread to the given CPUs
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (int cpu : cpus) { CPU_SET(cpu, &set); }
+    return pthread_setaffinity_np(thread, sizeof(set), &set) == 0;
+}
+
+template <class F>
+void parallel_for(int n, F f) {
+    // Calls f(i) for every i in [0, n), split into contiguous chunks over num_threads() threads
+    int nt = std::min(num_threads(), n);
+    if (nt <= 1) {
+        for (int i = 0; i < n; i++) { f(i); }
+        return;
+    }
+    std::vector<std::thread> threads;
+    for (int t = 1; t < nt; t++) {
+        threads.emplace_back([&f, t, n, nt] {
+            for (int i = int(long(n) * t / nt); i < int(long(n) * (t + 1) / nt); i++) { f(i); }
+        });
+    }
+    for (int i = 0; i < int(long(n) / nt); i++) { f(i); }
+    for (std::thread& th : threads) { th.join(); }
+}
+
+class WorkStealingPool {
+    // A fixed set of worker threads, each owning a deque of task indices. A batch of tasks is dealt out
+    // in contiguous runs; a worker pops its own deque from the back and, once it is empty, steals from the
+    // front of randomly chosen victims, so a slow or preempted worker does not hold up the whole batch.
+    // Workers are spread over the NUMA nodes in contiguous groups; on a machine with several nodes each
+    // worker is pinned to the CPUs of its node and prefers to steal from workers of the same node
+public:
+    explicit WorkStealingPool(int workers) : queues_(workers), worker_node_(workers) {
+        const NumaTopology& topology = numa_topology();
+        nodes_ = std::min(topology.nodes(), workers);
+        node_workers_.resize(nodes_);
+        for (int w = 0; w < workers; w++) {
+            worker_node_[w] = int(long(w) * nodes_ / workers);
+            node_workers_[worker_node_[w]].push_back(w);
+            all_workers_.push_back(w);
+        }
+        pinned_ = topology.nodes() > 1;
+        for (int w = 1; w < workers; w++) {
+            threads_.emplace_back([this, w] { worker_main(w); });
+            if (pinned_) { pin_thread(threads_.back().native_handle(), topology.node_cpus[worker_node_[w]]); }
+        }
+    }
+
+    ~WorkStealingPool() {
+        {
+            std::lock_guard<std::mutex> lock(wake_mutex_);
+            stop_ = true;
+        }
+        wake_.notify_all();
+        for (std::thread& th : threads_) { th.join(); }
+    }
+
+    static WorkStealingPool& instance() {
+        // The pool shared by all parallel kernels, with num_threads() workers including the caller
+        static WorkStealingPool pool(num_threads());
+        return pool;
+    }
+
+    int size() const { return int(queues_.size()); }
+
+    int nodes() const { return nodes_; }
+
+    int worker_node(int w) const { return worker_node_[w]; }
+
+    template <class F>
+    void run(int n, F&& f) {
+        // Calls f(task, worker) for every task in [0, n) and returns once all of them are done.
+        // The calling thread works as worker 0; calls from inside a task run inline on that worker
+        run_placed(n, nullptr, false, std::forward<F>(f));
+    }
+
+    template <class F>
+    void run_placed(int n, const std::function<int(int)>& node_of, bool strict, F&& f) {
+        // Like run(), but task t is queued on the workers of NUMA node node_of(t). A strict batch is
+        // never stolen across nodes, which is what first-touch placement of memory relies on
+        if (n <= 0) { return; }
+        if (current_worker >= 0 || size() == 1) {
+            int w = std::max(current_worker, 0);
+            for (int t = 0; t < n; t++) { f(t, w); }
+            return;
+        }
+
+        std::lock_guard<std::mutex> batch_lock(batch_mutex_);
+        std::function<void(int, int)> body = std::forward<F>(f);
+        body_ = &body;
+        strict_ = strict;
+        pending_.store(n);
+        std::vector<std::vector<int>> by_node(nodes_);
+        for (int t = 0; t < n; t++) {
+            by_node[node_of ? node_of(t) % nodes_ : 0].push_back(t);
+        }
+        for (int d = 0; d < nodes_; d++) {
+            // Without placement all tasks are dealt out over all workers
+            const std::vector<int>& workers = node_of ? node_workers_[d] : all_workers_;
+            int count = int(by_node[d].size()), parts = int(workers.size());
+            for (int i = 0; i < parts; i++) {
+                std::lock_guard<std::mutex> lock(queues_[workers[i]].mutex);
+                for (int j = int(long(count) * i / parts); j < int(long(count) * (i + 1) / parts); j++) {
+                    queues_[workers[i]].tasks.push_back(by_node[d][j]);
+                }
+            }
+        }
+        {
+            std::lock_guard<std::mutex> lock(wake_mutex_);
+            generation_++;
+        }
+        wake_.notify_all();
+
+        // The caller is worker 0 of node 0, so while it works it is kept on the CPUs of that node
+        cpu_set_t saved;
+        bool restore = pinned_ && pthread_getaffinity_np(pthread_self(), sizeof(saved), &saved) == 0 &&
+                       pin_thread(pthread_self(), numa_topology().node_cpus[0]);
+        current_worker = 0;
+        work(0);
+        current_worker = -1;
+        if (restore) { pthread_setaffinity_np(pthread_self(), sizeof(saved), &saved); }
+        // Every task has been popped and finished here, so no worker dereferences body_ any more
+    }
+
+private:
+    struct alignas(64) Queue {
+        std::mutex mutex;
+        std::deque<int> tasks;
+    };
+
+    static thread_local int current_worker;
+
+    bool pop(int w, int& task) {
+        std::lock_guard<std::mutex> lock(queues_[w].mutex);
+        if (queues_[w].tasks.empty()) { return false; }
+        task = queues_[w].tasks.back();
+        queues_[w].tasks.pop_back();
+        return true;
+    }
+
+    bool steal_from(const std::vector<int>& victims, int w, std::minstd_rand& rng, int& task) {
+        // One sweep over the victims, starting from a random one
+        int count = int(victims.size());
+        int first = int(rng() % count);
+        for (int i = 0; i < count; i++) {
+            int victim = victims[(first + i) % count];
+            if (victim == w) { continue; }
+            std::lock_guard<std::mutex> lock(queues_[victim].mutex);
+            if (!queues_[victim].tasks.empty()) {
+                task = queues_[victim].tasks.front();
+                queues_[victim].tasks.pop_front();
+                return true;
+            }
+        }
+        return false;
+    }
+
+    bool steal(int w, std::minstd_rand& rng, int& task) {
+        // Workers of the same node first, then, unless the batch is strict, everybody else
+        if (steal_from(node_workers_[worker_node_[w]], w, rng, task)) { return true; }
+        return nodes_ > 1 && !strict_ && steal_from(all_workers_, w, rng, task);
+    }
+
+    void work(int w) {
+        std::minstd_rand rng(w + 1);
+        while (pending_.load() > 0) {
+            int task;
+            if (pop(w, task) || steal(w, rng, task)) {
+                (*body_)(task, w);
+                pending_.fetch_sub(1);
+            } else {
+                std::this_thread::yield();
+            }
+        }
+    }
+
+    void worker_main(int w) {
+        current_worker = w;
+        long seen = 0;
+        for (;;) {
+            {
+                std::unique_lock<std::mutex> lock(wake_mutex_);
+                wake_.wait(lock, [&] { return stop_ || generation_ != seen; });
+                if (stop_) { return; }
+                seen = generation_;
+            }
+            work(w);
+        }
+    }
+
+    std::vector<Queue> queues_;
+    std::vector<int> worker_node_;
+    std::vector<std::vector<int>> node_workers_;
+    std::vector<int> all_workers_;
+    int nodes_ = 1;
+    bool pinned_ = false;
+    std::atomic<bool> strict_{ false };
+    std::vector<std::thread> threads_;
+    std::mutex batch_mutex_;
+    std::mutex wake_mutex_;
+    std::condition_variable wake_;
+    long generation_ = 0;
+    bool stop_ = false;
+    std::atomic<int> pending_{ 0 };
+    std::function<void(int, int)>* body_ = nullptr;
+};
+
+thread_local int WorkStealingPool::current_worker = -1;
+
+template <class T>
+MULTIVERSION
+void pack_sliver(int kc, int width, const T* __restrict__ src, int ld, T* __restrict__ dst, int w, T alpha) {
+    // Copies the rows src[k * ld + 0 : width] of a kc-deep sliver, scaled by alpha, into dst[k * w + 0 : w],
+    // zero-filling the columns width..w. Both operands of the aT * b product are packed this way: a sliver
+    // of aT is mr consecutive m, a sliver of b is nr consecutive n, and both run along k in memory. T is float
+    // or double, the element type of the microkernels; narrower storage has its own widening overloads below
+    for (int k = 0; k < kc; k++) {
+        for (int j = 0; j < width; j++) {
+            dst[k * w + j] = alpha * src[long(k) * ld + j];
+        }
+        for (int j = width; j < w; j++) {
+            dst[k * w + j] = T(0);
+        }
+    }
+}
+
+template <class T>
+MULTIVERSION
+void pack_sliver_transposed(int kc, int width, const T* __restrict__ src, int ld, T* __restrict__ dst, int w, T alpha) {
+    // The same sliver for an operand stored the other way round, with k running along the rows src[j * ld + k]:
+    // mr rows of a row-major a, or nr rows of bT. Each row is read sequentially and scattered into dst
+    for (int j = 0; j < width; j++) {
+        for (int k = 0; k < kc; k++) {
+            dst[k * w + j] = alpha * src[long(j) * ld + k];
+        }
+    }
+    for (int k = 0; k < kc; k++) {
+        for (int j = width; j < w; j++) {
+            dst[k * w + j] = T(0);
+        }
+    }
+}
+
+struct half {
+    // An IEEE binary16 value, kept as its bits
+    uint16_t bits;
+};
+
+float half_to_float(half h) {
+    // Widens binary16 to binary32 exactly, including subnormals, infinities and NaNs
+    uint32_t sign = uint32_t(h.bits & 0x8000) << 16, exponent = (h.bits >> 10) & 0x1F, mantissa = h.bits & 0x3FF;
+    uint32_t bits;
+    if (exponent == 0x1F) {
+        bits = sign | 0x7F800000 | mantissa << 13;
+    } else if (exponent != 0) {
+        bits = sign | (exponent + 112) << 23 | mantissa << 13;
+    } else if (mantissa == 0) {
+        bits = sign;
+    } else {
+        // A subnormal half is a normal float: shift the leading one into the implicit bit
+        int shift = 0;
+        while (!(mantissa & 0x400)) {
+            mantissa <<= 1;
+            shift++;
+        }
+        bits = sign | uint32_t(113 - shift) << 23 | (mantissa & 0x3FF) << 13;
+    }
+    float f;
+    std::memcpy(&f, &bits, sizeof(f));
+    return f;
+}
+
+half float_to_half(float f) {
+    // Narrows binary32 to binary16, rounding to nearest even like vcvtps2ph; overflow gives infinity
+    uint32_t bits;
+    std::memcpy(&bits, &f, sizeof(bits));
+    uint16_t sign = (bits >> 16) & 0x8000;
+    uint32_t abs = bits & 0x7FFFFFFF;
+    if (abs > 0x7F800000) { return { uint16_t(sign | 0x7E00 | (abs >> 13 & 0x3FF)) }; }
+    if (abs >= 0x477FF000) { return { uint16_t(sign | 0x7C00) }; }
+    if (abs < 0x38800000) {
+        // Subnormal or zero: align the mantissa with its implicit one to the half's fixed exponent
+        if (abs < 0x33000000) { return { sign }; }
+        uint32_t mantissa = (abs & 0x7FFFFF) | 0x800000;
+        int shift = 126 - int(abs >> 23);
+        uint32_t rounded = mantissa >> shift, rest = mantissa & ((1u << shift) - 1), halfway = 1u << (shift - 1);
+        rounded += rest > halfway || (rest == halfway && (rounded & 1));
+        return { uint16_t(sign | rounded) };
+    }
+    uint32_t rounded = abs - 0x38000000;
+    rounded += 0xFFF + ((rounded >> 13) & 1);
+    return { uint16_t(sign | rounded >> 13) };
+}
+
+bool has_f16c() {
+    // vcvtph2ps / vcvtps2ph are used along with the AVX2 and AVX-512 microkernels, so TVM_LEARN_ISA=sse or
+    // generic also selects the portable conversions
+    static const bool f16c = __builtin_cpu_supports("f16c") && kernel_info().isa >= Isa::avx2;
+    return f16c;
+}
+
+TARGET_F16C
+void pack_sliver_f16c(int kc, int width, const half* __restrict__ src, int ld, float* __restrict__ dst, int w, float alpha) {
+    // pack_sliver of fp16 rows, widened eight at a time by vcvtph2ps
+    __m256 valpha = _mm256_set1_ps(alpha);
+    for (int k = 0; k < kc; k++) {
+        int j = 0;
+        for (; j + 8 <= width; j += 8) {
+            __m128i h = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + long(k) * ld + j));
+            _mm256_storeu_ps(dst + k * w + j, _mm256_mul_ps(valpha, _mm256_cvtph_ps(h)));
+        }
+        for (; j < width; j++) {
+            dst[k * w + j] = alpha * _cvtsh_ss(src[long(k) * ld + j].bits);
+        }
+        for (; j < w; j++) {
+            dst[k * w + j] = 0.0;
+        }
+    }
+}
+
+TARGET_F16C
+void pack_sliver_transposed_f16c(int kc, int width, const half* __restrict__ src, int ld, float* __restrict__ dst, int w,
+                                 float alpha) {
+    // pack_sliver_transposed of fp16 rows, each widened eight at a time by vcvtph2ps and scattered into dst
+    __m256 valpha = _mm256_set1_ps(alpha);
+    for (int j = 0; j < width; j++) {
+        int k = 0;
+        for (; k + 8 <= kc; k += 8) {
+            __m128i h = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + long(j) * ld + k));
+            alignas(32) float row[8];
+            _mm256_store_ps(row, _mm256_mul_ps(valpha, _mm256_cvtph_ps(h)));
+            for (int i = 0; i < 8; i++) {
+                dst[(k + i) * w + j] = row[i];
+            }
+        }
+        for (; k < kc; k++) {
+            dst[k * w + j] = alpha * _cvtsh_ss(src[long(j) * ld + k].bits);
+        }
+    }
+    for (int k = 0; k < kc; k++) {
+        for (int j = width; j < w; j++) {
+            dst[k * w + j] = 0.0;
+        }
+    }
+}
+
+void pack_sliver(int kc, int width, const half* __restrict__ src, int ld, float* __restrict__ dst, int w, float alpha) {
+    // pack_sliver of fp16 storage: the packed sliver is fp32, so the microkernels are the same as for sgemm
+    if (has_f16c()) {
+        pack_sliver_f16c(kc, width, src, ld, dst, w, alpha);
+        return;
+    }
+    for (int k = 0; k < kc; k++) {
+        for (int j = 0; j < w; j++) {
+            dst[k * w + j] = j < width ? alpha * half_to_float(src[long(k) * ld + j]) : 0.0f;
+        }
+    }
+}
+
+void pack_sliver_transposed(int kc, int width, const half* __restrict__ src, int ld, float* __restrict__ dst, int w,
+                            float alpha) {
+    // pack_sliver_transposed of fp16 storage
+    if (has_f16c()) {
+        pack_sliver_transposed_f16c(kc, width, src, ld, dst, w, alpha);
+        return;
+    }
+    for (int k = 0; k < kc; k++) {
+        for (int j = 0; j < w; j++) {
+            dst[k * w + j] = j < width ? alpha * half_to_float(src[long(j) * ld + k]) : 0.0f;
+        }
+    }
+}
+
+TARGET_F16C
+void store_half_tile_f16c(int mr, int nr, const float* __restrict__ src, int lds, float beta, half* __restrict__ dst, int ldd) {
+    // store_half_tile, eight values at a time through vcvtph2ps and vcvtps2ph
+    __m256 vbeta = _mm256_set1_ps(beta);
+    for (int i = 0; i < mr; i++) {
+        int j = 0;
+        for (; j + 8 <= nr; j += 8) {
+            __m256 v = _mm256_loadu_ps(src + i * lds + j);
+            __m128i* d = reinterpret_cast<__m128i*>(dst + long(i) * ldd + j);
+            if (beta != 0.0f) { v = _mm256_fmadd_ps(vbeta, _mm256_cvtph_ps(_mm_loadu_si128(d)), v); }
+            _mm_storeu_si128(d, _mm256_cvtps_ph(v, _MM_FROUND_TO_NEAREST_INT));
+        }
+        for (; j < nr; j++) {
+            float v = src[i * lds + j];
+            if (beta != 0.0f) { v += beta * _cvtsh_ss(dst[long(i) * ldd + j].bits); }
+            dst[long(i) * ldd + j].bits = _cvtss_sh(v, _MM_FROUND_TO_NEAREST_INT);
+        }
+    }
+}
+
+void store_half_tile(int mr, int nr, const float* __restrict__ src, int lds, float beta, half* __restrict__ dst, int ldd) {
+    // dst = src + beta * dst for an fp32 tile and fp16 dst, narrowing the result once; beta = 0 does not read dst
+    if (has_f16c()) {
+        store_half_tile_f16c(mr, nr, src, lds, beta, dst, ldd);
+        return;
+    }
+    for (int i = 0; i < mr; i++) {
+        for (int j = 0; j < nr; j++) {
+            float v = src[i * lds + j];
+            if (beta != 0.0f) { v += beta * half_to_float(dst[long(i) * ldd + j]); }
+            dst[long(i) * ldd + j] = float_to_half(v);
+        }
+    }
+}
+
+struct bf16 {
+    // A bfloat16 value, kept as its bits: the upper half of a binary32
+    uint16_t bits;
+};
+
+inline float bf16_to_float(bf16 h) {
+    // Exact: the bits go to the upper half of a float
+    uint32_t bits = uint32_t(h.bits) << 16;
+    float f;
+    std::memcpy(&f, &bits, sizeof(f));
+    return f;
+}
+
+inline bf16 float_to_bf16(float f) {
+    // Rounds to nearest even like vcvtneps2bf16, except that subnormals are kept where it flushes them to zero;
+    // NaNs stay quiet NaNs
+    uint32_t bits;
+    std::memcpy(&bits, &f, sizeof(bits));
+    if ((bits & 0x7FFFFFFF) > 0x7F800000) { return { uint16_t(bits >> 16 | 0x40) }; }
+    return { uint16_t((bits + 0x7FFF + (bits >> 16 & 1)) >> 16) };
+}
+
+MULTIVERSION
+void pack_sliver(int kc, int width, const bf16* __restrict__ src, int ld, float* __restrict__ dst, int w, float alpha) {
+    // pack_sliver of bf16 storage, widened by a 16-bit shift: this and the fp32 microkernels are the portable
+    // emulation of the vdpbf16ps path
+    for (int k = 0; k < kc; k++) {
+        for (int j = 0; j < width; j++) {
+            dst[k * w + j] = alpha * bf16_to_float(src[long(k) * ld + j]);
+        }
+        for (int j = width; j < w; j++) {
+            dst[k * w + j] = 0.0;
+        }
+    }
+}
+
+MULTIVERSION
+void pack_sliver_transposed(int kc, int width, const bf16* __restrict__ src, int ld, float* __restrict__ dst, int w,
+                            float alpha) {
+    // pack_sliver_transposed of bf16 storage
+    for (int j = 0; j < width; j++) {
+        for (int k = 0; k < kc; k++) {
+            dst[k * w + j] = alpha * bf16_to_float(src[long(j) * ld + k]);
+        }
+    }
+    for (int k = 0; k < kc; k++) {
+        for (int j = width; j < w; j++) {
+            dst[k * w + j] = 0.0;
+        }
+    }
+}
+
+// Blocks with fewer elements than this are packed by the calling thread only
+constexpr long PARALLEL_PACK_MIN = 64 * 1024;
+
+void pack_a(int mc, int kc, const float* __restrict__ aT, int lda, float* __restrict__ pa, int mr, bool parallel) {
+    // Packs the mc x kc block a[m, k] = aT[k * lda + m] into strips of mr rows: pa[s][k][0:mr]
+    int strips = (mc + mr - 1) / mr;
+    auto pack_strip = [&](int s) {
+        pack_sliver(kc, std::min(mr, mc - s * mr), aT + s * mr, lda, pa + long(s) * kc * mr, mr, 1.0f);
+    };
+    if (!parallel || long(mc) * kc < PARALLEL_PACK_MIN) {
+        for (int s = 0; s < strips; s++) { pack_strip(s); }
+    } else {
+        WorkStealingPool::instance().run(strips, [&](int t, int) { pack_strip(t); });
+    }
+}
+
+void pack_b(int kc, int nc, const float* __restrict__ b, int ldb, float* __restrict__ pb, int nr, bool parallel) {
+    // Packs the kc x nc block b[k, n] = b[k * ldb + n] into panels of nr columns: pb[p][k][0:nr]
+    int panels = (nc + nr - 1) / nr;
+    auto pack_panel = [&](int p) {
+        pack_sliver(kc, std::min(nr, nc - p * nr), b + p * nr, ldb, pb + long(p) * kc * nr, nr, 1.0f);
+    };
+    if (!parallel || long(kc) * nc < PARALLEL_PACK_MIN) {
+        for (int p = 0; p < panels; p++) { pack_panel(p); }
+    } else {
+        WorkStealingPool::instance().run(panels, [&](int t, int) { pack_panel(t); });
+    }
+}
+
+void gemm_packed_aT(const float* __restrict__ aT, int lda, const float* __restrict__ b, int ldb, float* __restrict__ c, int ldc,
+                    int M, int K, int N, const BlockSizes& bs, float* __restrict__ pa, float* __restrict__ pb, bool parallel_pack) {
+    // c[0:M, 0:N] = a[0:M, 0:K] * b[0:K, 0:N] with a[m, k] = aT[k * lda + m], b[k, n] = b[k * ldb + n] and
+    // c[m, n] = c[m * ldc + n], blocked for the caches and computed on packed operands. The workspaces pa and pb
+    // hold bs.mc x bs.kc and bs.kc x bs.nc floats
+    const KernelInfo& ki = kernel_info();
+    assert(bs.mc % ki.mr == 0 && bs.nc % ki.nr == 0);
+    if (K <= 0) {
+        scale_matrix(M, N, 0.0f, c, ldc);
+        return;
+    }
+    for (int jc = 0; jc < N; jc += bs.nc) {
+        int nc = std::min(bs.nc, N - jc);
+        for (int pc = 0; pc < K; pc += bs.kc) {
+            int kc = std::min(bs.kc, K - pc);
+            pack_b(kc, nc, b + long(pc) * ldb + jc, ldb, pb, ki.nr, parallel_pack);
+            for (int ic = 0; ic < M; ic += bs.mc) {
+                int mc = std::min(bs.mc, M - ic);
+                pack_a(mc, kc, aT + long(pc) * lda + ic, lda, pa, ki.mr, parallel_pack);
+                for (int jr = 0; jr < nc; jr += ki.nr) {
+                    for (int ir = 0; ir < mc; ir += ki.mr) {
+                        ki.ukernel(kc, pa + ir * kc, ki.mr, pb + jr * kc, ki.nr, c + long(ic + ir) * ldc + jc + jr, ldc,
+                                   std::min(ki.mr, mc - ir), std::min(ki.nr, nc - jr), pc > 0 ? 1.0f : 0.0f,
+                                   nullptr);
+                    }
+                }
+            }
+        }
+    }
+}
+
+void multiply_v6_aT(const float* __restrict__ aT, const float* __restrict__ b, float* __restrict__ c, int M, int K, int N,
+                    const BlockSizes& bs) {
+    // c = aT * b, the five loops of v5 running on packed copies of a and b, the same way TVM's packedB
+    // schedule does: every mr x kc strip of a and kc x nr panel of b is contiguous in memory
+    aligned_vector pa(std::size_t(bs.mc) * bs.kc);
+    aligned_vector pb(std::size_t(bs.kc) * bs.nc);
+    gemm_packed_aT(aT, M, b, N, c, N, M, K, N, bs, pa.data(), pb.data(), true);
+}
+
+// Floats per cache line. Column boundaries between threads fall on multiples of this,
+// so two threads never write the same line of a line-aligned c
+constexpr int CACHE_LINE_FLOATS = 64 / sizeof(float);
+
+void thread_grid(int M, int N, int nt, int m_unit, int n_unit, int& tm, int& tn) {
+    // Splits nt threads into a tm x tn grid over c. Among the factorizations whose tiles are at least one
+    // unit in size, the one with the most square tiles is taken, so a skinny c is split along its long side
+    int m_units = (M + m_unit - 1) / m_unit;
+    int n_units = (N + n_unit - 1) / n_unit;
+    for (; nt > 1; nt--) {
+        double best = -1.0;
+        for (int d = 1; d <= nt; d++) {
+            if (nt % d != 0 || nt / d > m_units || d > n_units) { continue; }
+            double h = double(M) / (nt / d), w = double(N) / d;
+            double squareness = std::min(h, w) / std::max(h, w);
+            if (squareness > best) {
+                best = squareness;
+                tm = nt / d;
+                tn = d;
+            }
+        }
+        if (best >= 0.0) { return; }
+    }
+    tm = tn = 1;
+}
+
+int split_point(int size, int parts, int i, int unit) {
+    // Start of part i when size is split into parts of whole units as evenly as possible
+    int units = (size + unit - 1) / unit;
+    return std::min(size, int(long(units) * i / parts) * unit);
+}
+
+void multiply_v7_aT_static(const float* __restrict__ aT, const float* __restrict__ b, float* __restrict__ c, int M, int K, int N,
+                           const BlockSizes& bs) {
+    // c = aT * b on all threads with a fixed partitioning: c is split both over M and over N, so even a skinny
+    // N = 128 keeps every core busy. Each thread runs the packed five-loop GEMM on its own tile and workspace
+    const KernelInfo& ki = kernel_info();
+    int n_unit = std::max(ki.nr, CACHE_LINE_FLOATS);
+    n_unit = n_unit % ki.nr == 0 && n_unit % CACHE_LINE_FLOATS == 0 ? n_unit : ki.nr * CACHE_LINE_FLOATS;
+    int tm = 1, tn = 1;
+    thread_grid(M, N, num_threads(), ki.mr, n_unit, tm, tn);
+
+    parallel_for(tm * tn, [&](int t) {
+        int m0 = split_point(M, tm, t / tn, ki.mr), m1 = split_point(M, tm, t / tn + 1, ki.mr);
+        int n0 = split_point(N, tn, t % tn, n_unit), n1 = split_point(N, tn, t % tn + 1, n_unit);
+        if (m0 == m1 || n0 == n1) { return; }
+        // Allocated by the thread itself, each workspace is cache-line aligned and padded to whole lines
+        aligned_vector pa(std::size_t(bs.mc) * bs.kc);
+        aligned_vector pb(std::size_t(bs.kc) * bs.nc);
+        gemm_packed_aT(aT + m0, M, b + n0, N, c + long(m0) * N + n0, N, m1 - m0, K, n1 - n0, bs,
+                       pa.data(), pb.data(), false);
+    });
+}
+
+// Macro-tiles per worker the work-stealing GEMM aims for, so that stealing has something to balance
+constexpr int TILES_PER_WORKER = 4;
+
+void macro_tiles(int M, int N, int m_unit, int n_unit, const BlockSizes& bs, int want, int& tile_m, int& tile_n) {
+    // Cuts c into tiles of at most bs.mc x bs.nc, halving the longer side until there are want tiles
+    tile_m = std::min(bs.mc, (M + m_unit - 1) / m_unit * m_unit);
+    tile_n = std::min(bs.nc / n_unit * n_unit, (N + n_unit - 1) / n_unit * n_unit);
+    tile_n = std::max(tile_n, n_unit);
+    while (long((M + tile_m - 1) / tile_m) * ((N + tile_n - 1) / tile_n) < want) {
+        if (tile_m > m_unit && (tile_m >= tile_n || tile_n <= n_unit)) {
+            tile_m = (tile_m / 2 + m_unit - 1) / m_unit * m_unit;
+        } else if (tile_n > n_unit) {
+            tile_n = (tile_n / 2 + n_unit - 1) / n_unit * n_unit;
+        } else {
+            break;
+        }
+    }
+}
+
+template <class T = float>
+const BlockSizes& default_blocks() {
+    // Block sizes of default_block_sizes() for the selected microkernel of T, computed once
+    static const BlockSizes bs = default_block_sizes(kernel_info<T>());
+    return bs;
+}
+
+std::string cpu_model() {
+    // The model name of this CPU from /proc/cpuinfo, which keys the tuning file
+    std::ifstream cpuinfo("/proc/cpuinfo");
+    std::string line;
+    while (std::getline(cpuinfo, line)) {
+        if (line.rfind("model name", 0) == 0 && line.find(':') != std::string::npos) {
+            return line.substr(line.find_first_not_of(" \t", line.find(':') + 1));
+        }
+    }
+    return "unknown";
+}
+
+std::string tuning_path() {
+    // The tuning file: TVM_LEARN_TUNING if set, otherwise tvm_learn_tuning.txt in the working directory
+    const char* env = std::getenv("TVM_LEARN_TUNING");
+    return env ? env : "tvm_learn_tuning.txt";
+}
+
+struct Tuning {
+    // Measured parameters for one shape: the cache blocking of sgemm and the tile of multiply_tiled_aT
+    BlockSizes blocks;
+    int mb;
+    int nb;
+    int kb;
+};
+
+// CPU model, microkernel ISA, M, K, N
+using TuningKey = std::tuple<std::string, std::string, int, int, int>;
+
+struct TuningFile {
+    // The entries per shape, and the Strassen cutoff of sgemm_strassen per CPU model and microkernel ISA
+    std::map<TuningKey, Tuning> shapes;
+    std::map<std::pair<std::string, std::string>, int> strassen_cutoffs;
+};
+
+TuningFile read_tuning_file(const std::string& path) {
+    // All entries of a tuning file, one per line as "cpu model|isa|M K N|mc kc nc|mb nb kb" or
+    // "cpu model|isa|strassen|cutoff". Malformed lines are skipped, a missing file is empty
+    TuningFile entries;
+    std::ifstream file(path);
+    std::string line;
+    while (std::getline(file, line)) {
+        std::vector<std::string> fields;
+        std::size_t begin = 0, end;
+        while ((end = line.find('|', begin)) != std::string::npos) {
+            fields.push_back(line.substr(begin, end - begin));
+            begin = end + 1;
+        }
+        fields.push_back(line.substr(begin));
+        int M, K, N, cutoff;
+        Tuning t;
+        if (fields.size() == 5 && std::sscanf(fields[2].c_str(), "%d %d %d", &M, &K, &N) == 3 &&
+            std::sscanf(fields[3].c_str(), "%d %d %d", &t.blocks.mc, &t.blocks.kc, &t.blocks.nc) == 3 &&
+            std::sscanf(fields[4].c_str(), "%d %d %d", &t.mb, &t.nb, &t.kb) == 3) {
+            entries.shapes[{ fields[0], fields[1], M, K, N }] = t;
+        } else if (fields.size() == 4 && fields[2] == "strassen" && std::sscanf(fields[3].c_str(), "%d", &cutoff) == 1) {
+            entries.strassen_cutoffs[{ fields[0], fields[1] }] = cutoff;
+        }
+    }
+    return entries;
+}
+
+void write_tuning_file(const std::string& path, const TuningFile& entries) {
+    // Writes the entries in the format of read_tuning_file
+    std::ofstream file(path);
+    for (const auto& [key, t] : entries.shapes) {
+        const auto& [cpu, isa, M, K, N] = key;
+        file << cpu << "|" << isa << "|" << M << " " << K << " " << N << "|" << t.blocks.mc << " " << t.blocks.kc << " "
+             << t.blocks.nc << "|" << t.mb << " " << t.nb << " " << t.kb << "\n";
+    }
+    for (const auto& [key, cutoff] : entries.strassen_cutoffs) {
+        file << key.first << "|" << key.second << "|strassen|" << cutoff << "\n";
+    }
+    if (!file) { throw std::runtime_error("cannot write the tuning file " + path); }
+}
+
+const TuningFile& tuning_file() {
+    // The tuning file, read once at the first GEMM call
+    static const TuningFile entries = read_tuning_file(tuning_path());
+    return entries;
+}
+
+const Tuning* find_tuning(int M, int K, int N) {
+    // The tuning of this shape for this CPU and the selected microkernel; entries whose blocking does not fit the
+    // microkernel are ignored
+    const TuningFile& entries = tuning_file();
+    static const std::string cpu = cpu_model();
+    const KernelInfo& ki = kernel_info();
+    auto it = entries.shapes.find({ cpu, ki.name, M, K, N });
+    if (it == entries.shapes.end()) { return nullptr; }
+    const BlockSizes& bs = it->second.blocks;
+    if (bs.mc <= 0 || bs.mc % ki.mr != 0 || bs.kc <= 0 || bs.nc <= 0 || bs.nc % ki.nr != 0) { return nullptr; }
+    return &it->second;
+}
+
+const BlockSizes& tuned_blocks(int M, int K, int N) {
+    // The block sizes for this shape: measured by --autotune if the tuning file has them, otherwise the
+    // defaults. TVM_LEARN_BLOCKS takes precedence over both
+    const Tuning* t = std::getenv("TVM_LEARN_BLOCKS") ? nullptr : find_tuning(M, K, N);
+    return t ? t->blocks : default_blocks();
+}
+
+const TiledVariant& best_tiled_variant(int M, int K, int N) {
+    // The fastest tiled variant for this shape, from the tuning file or measured
+    if (const Tuning* t = find_tuning(M, K, N)) {
+        for (const TiledVariant& variant : tiled_variants) {
+            if (variant.mb == t->mb && variant.nb == t->nb && variant.kb == t->kb) { return variant; }
+        }
+    }
+    const std::vector<double>& times = tiled_variant_times(M, K, N);
+    return tiled_variants[std::min_element(times.begin(), times.end()) - times.begin()];
+}
+
+void multiply_tiled_best_aT(const float* __restrict__ aT, const float* __restrict__ b, float* __restrict__ c, int M, int K,
+                            int N) {
+    // c = aT * b with the tiled variant that is fastest for this shape
+    best_tiled_variant(M, K, N).multiply(aT, b, c, M, K, N, 1.0f, 0.0f);
+}
+
+template <class T, class P>
+void pack_op_a(char transA, int kc, int width, const T* __restrict__ A, int lda, int pc, int m, P* __restrict__ dst,
+               int mr, P alpha) {
+    // The sliver of op(A) at rows m.. and k = pc.., scaled by alpha, with the packing routine of its layout
+    if (transA == 'T') {
+        pack_sliver(kc, width, A + long(pc) * lda + m, lda, dst, mr, alpha);
+    } else {
+        pack_sliver_transposed(kc, width, A + long(m) * lda + pc, lda, dst, mr, alpha);
+    }
+}
+
+template <class T, class P>
+void pack_op_b(char transB, int kc, int width, const T* __restrict__ B, int ldb, int pc, int n, P* __restrict__ dst,
+               int nr) {
+    // The sliver of op(B) at k = pc.. and columns n.., with the packing routine of its layout
+    if (transB == 'N') {
+        pack_sliver(kc, width, B + long(pc) * ldb + n, ldb, dst, nr, P(1));
+    } else {
+        pack_sliver_transposed(kc, width, B + long(n) * ldb + pc, ldb, dst, nr, P(1));
+    }
+}
+
+// The element type of the packed operands and microkernels for operands of type T: double for double,
+// float for float and the narrower storage types, which are widened while packing
+template <class T>
+using packed_t = std::conditional_t<std::is_same_v<T, double>, double, float>;
+
+template <class T, class TC>
+void gemm_on_pool(char transA, char transB, int M, int N, int K, packed_t<T> alpha, const T* __restrict__ A, int lda,
+                  const T* __restrict__ B, int ldb, packed_t<T> beta, TC* __restrict__ C, int ldc, const Epilogue& ep,
+                  const BlockSizes& bs) {
+    // The engine of sgemm, dgemm, hgemm and the emulated bf16gemm, for operands of type T (float, double, half
+    // or bf16) and C of type TC (float, double or half), on the microkernels of P = packed_t<T>.
+    // Each layout has its own packing routine, so no operand is ever transposed in memory. The loops are those
+    // of gemm_serial: N is cut into L3 panels of nc columns and K into slabs of kc, and for each slab packing
+    // tasks on the work-stealing pool lay out the kc x nc block of op(B) as kc x nr slivers of P, then
+    // macro-tile tasks over the panel pack their strips of op(A), scaled by alpha, and run the microkernels.
+    // So the packed op(B) never exceeds kc x nc, whatever the shape. For C of type P, beta is applied by the
+    // microkernel as it stores the first K slab and ep as it stores the last one. For fp16 C the panel is
+    // summed up in an fp32 buffer and each macro tile narrowed once, after its last K slab; that buffer is
+    // kept within kc x nc floats as well by narrowing the panels. The epilogue is defined on floats and must
+    // be empty for double
+    using P = packed_t<T>;
+    assert(transA == 'N' || transA == 'T');
+    assert(transB == 'N' || transB == 'T');
+    constexpr bool half_c = std::is_same_v<TC, half>;
+    bool ep_in_registers = ep.bias || ep.residual || ep.act != Activation::none;
+    assert((std::is_same_v<P, float> || (!ep_in_registers && !ep.tile_fn)));
+    if (M <= 0 || N <= 0) { return; }
+    if (K <= 0 || alpha == P(0)) {
+        std::vector<P> cp(std::size_t(M) * N);
+        for (int m = 0; m < M; m++) {
+            for (int n = 0; n < N; n++) {
+                P v = 0;
+                if constexpr (half_c) {
+                    v = beta == 0.0f ? 0.0f : beta * half_to_float(C[long(m) * ldc + n]);
+                } else {
+                    v = beta == P(0) ? P(0) : beta * C[long(m) * ldc + n];
+                }
+                if constexpr (std::is_same_v<P, float>) { v = epilogue_scalar(v, ep, m, n); }
+                cp[long(m) * N + n] = v;
+            }
+        }
+        if constexpr (std::is_same_v<P, float>) {
+            if (ep.tile_fn) { ep.tile_fn(ep.ctx, 0, 0, M, N, cp.data(), N); }
+        }
+        for (int m = 0; m < M; m++) {
+            for (int n = 0; n < N; n++) {
+                if constexpr (half_c) {
+                    C[long(m) * ldc + n] = float_to_half(cp[long(m) * N + n]);
+                } else {
+                    C[long(m) * ldc + n] = cp[long(m) * N + n];
+                }
+            }
+        }
+        return;
+    }
+
+    const KernelInfoOf<P>& ki = kernel_info<P>();
+    WorkStealingPool& pool = WorkStealingPool::instance();
+    constexpr int line = 64 / sizeof(P);
+    int n_unit = std::max(ki.nr, line);
+    n_unit = n_unit % ki.nr == 0 && n_unit % line == 0 ? n_unit : ki.nr * line;
+
+    // Panels of nc columns, whole units of n_unit; for fp16 C narrow enough for the fp32 sums of M rows to fit
+    // in kc x nc floats
+    int panel_n = bs.nc;
+    if constexpr (half_c) { panel_n = int(std::min<long>(panel_n, long(bs.kc) * bs.nc / M)); }
+    panel_n = std::min(std::max(panel_n / n_unit * n_unit, n_unit), (N + n_unit - 1) / n_unit * n_unit);
+    int kc_max = std::min(bs.kc, K);
+    // The packed kc x nc block of op(B): sliver p, holding columns jc + p * nr ..., is pb[p * kc * nr], with
+    // the last one zero-padded to nr columns
+    std::vector<P, AlignedAllocator<P>> pb(std::size_t(kc_max) * panel_n);
+    // The fp32 sums of the panel for fp16 C, at cw[m * panel_n + n - jc]
+    aligned_vector cw(half_c ? std::size_t(M) * panel_n : 0);
+
+    int tile_m, tile_n;
+    macro_tiles(M, panel_n, ki.mr, n_unit, bs, TILES_PER_WORKER * pool.size(), tile_m, tile_n);
+    std::vector<std::vector<P, AlignedAllocator<P>>> pa(pool.size());
+    for (int jc = 0; jc < N; jc += panel_n) {
+        int nc = std::min(panel_n, N - jc);
+        int panels = (nc + ki.nr - 1) / ki.nr;
+        int tiles_n = (nc + tile_n - 1) / tile_n;
+        int tiles = (M + tile_m - 1) / tile_m * tiles_n;
+        for (int pc = 0; pc < K; pc += bs.kc) {
+            int kc = std::min(bs.kc, K - pc);
+            pool.run(panels, [&](int p, int) {
+                pack_op_b(transB, kc, std::min(ki.nr, nc - p * ki.nr), B, ldb, pc, jc + p * ki.nr,
+                          pb.data() + long(p) * kc * ki.nr, ki.nr);
+            });
+            // beta applies to the first K slab only, the following ones add to it; ep is applied by the last one.
+            // The fp32 sums of an fp16 C start from zero, beta is applied when narrowing
+            P beta_slab = pc > 0 ? P(1) : half_c ? P(0) : beta;
+            bool last = pc + kc == K;
+            pool.run(tiles, [&](int t, int w) {
+                int m0 = t / tiles_n * tile_m, m1 = std::min(M, m0 + tile_m);
+                int n0 = jc + t % tiles_n * tile_n, n1 = std::min(jc + nc, n0 + tile_n);
+                auto& pa_w = pa[w];
+                if (pa_w.empty()) { pa_w.resize(std::size_t(tile_m) * kc_max); }
+                for (int ir = 0; ir < m1 - m0; ir += ki.mr) {
+                    pack_op_a(transA, kc, std::min(ki.mr, m1 - m0 - ir), A, lda, pc, m0 + ir, pa_w.data() + long(ir) * kc,
+                              ki.mr, alpha);
+                }
+                for (int jr = n0; jr < n1; jr += ki.nr) {
+                    for (int ir = 0; ir < m1 - m0; ir += ki.mr) {
+                        int mr = std::min(ki.mr, m1 - m0 - ir), nr = std::min(ki.nr, n1 - jr);
+                        P* c_tile;
+                        int ld_tile;
+                        if constexpr (half_c) {
+                            c_tile = cw.data() + long(m0 + ir) * panel_n + jr - jc;
+                            ld_tile = panel_n;
+                        } else {
+                            c_tile = C + long(m0 + ir) * ldc + jr;
+                            ld_tile = ldc;
+                        }
+                        Epilogue ep_tile = shift_epilogue(ep, m0 + ir, jr);
+                        ki.ukernel(kc, pa_w.data() + ir * kc, ki.mr, pb.data() + long(jr - jc) / ki.nr * kc * ki.nr,
+                                   ki.nr, c_tile, ld_tile, mr, nr, beta_slab, last && ep_in_registers ? &ep_tile : nullptr);
+                        if constexpr (std::is_same_v<P, float>) {
+                            if (last && ep.tile_fn) { ep.tile_fn(ep.ctx, m0 + ir, jr, mr, nr, c_tile, ld_tile); }
+                        }
+                    }
+                }
+                if constexpr (half_c) {
+                    if (last) {
+                        store_half_tile(m1 - m0, n1 - n0, cw.data() + long(m0) * panel_n + n0 - jc, panel_n, beta,
+                                        C + long(m0) * ldc + n0, ldc);
+                    }
+                }
+            });
+        }
+    }
+}
+
+// 16 floats as one value of GCC's generic vector extension. Each function below that uses it is compiled for
+// one ISA, and the compiler splits the type into as many registers of that ISA as needed: one zmm, two ymm
+// or four xmm
+typedef float vfloat16 __attribute__((vector_size(64)));
+// The vectors of one ymm and one xmm register, for kernels that keep each value in a single register of any ISA
+typedef float vfloat8 __attribute__((vector_size(32)));
+typedef float vfloat4 __attribute__((vector_size(16)));
+
+// sgemm hands products with at most this many columns of C to the GEMV engine, which streams A once for all of them
+constexpr int GEMV_MAX_N = 4;
+// Rows of A the row-major GEMV kernel takes together at most, sharing each load of x, and the SIMD width of the
+// partial sums of stream_read_gbps, which reads memory as that kernel does
+constexpr int GEMV_ROWS = 4;
+constexpr int GEMV_LANES = 8;
+// Width of the column chunks of y the aT GEMV kernel keeps in L1 while it sweeps K, 4 rows of A at a time
+constexpr int GEMV_CHUNK = 512;
+
+template <class Vec, int NV, int ACCS>
+__attribute__((always_inline)) inline
+void gemv_rows_n(int m0, int m1, int K, const float* __restrict__ A, int lda, const float* __restrict__ xp, float alpha,
+                 float beta, float* __restrict__ y, int ldy) {
+    // Rows m0 .. m1 of y = alpha * A * x + beta * y for a row-major A and the NV vectors x_j = xp[j * K ..], in runs
+    // of R rows: every row keeps a Vec, one register, of partial sums per vector, each load of x serves all R rows,
+    // and the R x NV sums are independent chains of FMAs. R is the most rows, up to GEMV_ROWS, whose sums fit the
+    // ACCS registers of the ISA's budget, so that they are never spilled. A short run repeats its last row, whose
+    // result is then dropped
+    constexpr int R = std::min(GEMV_ROWS, std::max(1, ACCS / NV)), V = sizeof(Vec) / sizeof(float);
+    const int k_full = K / V * V;
+    for (int m = m0; m < m1; m += R) {
+        int rows = std::min(R, m1 - m);
+        const float* __restrict__ a_rows[R];
+        for (int i = 0; i < R; i++) { a_rows[i] = A + long(m + std::min(i, rows - 1)) * lda; }
+        Vec acc[R][NV] = {};
+        // The loops over rows and vectors are unrolled, which -O2 does not do by itself, so that acc is registers
+        for (int k = 0; k < k_full; k += V) {
+            Vec xv[NV];
+#pragma GCC unroll 4
+            for (int j = 0; j < NV; j++) { std::memcpy(&xv[j], xp + long(j) * K + k, sizeof(Vec)); }
+#pragma GCC unroll 4
+            for (int i = 0; i < R; i++) {
+                Vec av;
+                std::memcpy(&av, a_rows[i] + k, sizeof(Vec));
+#pragma GCC unroll 4
+                for (int j = 0; j < NV; j++) { acc[i][j] += av * xv[j]; }
+            }
+        }
+        for (int i = 0; i < rows; i++) {
+            for (int j = 0; j < NV; j++) {
+                // The partial sums are added up pairwise, halving the vector each step
+                float sums[V];
+                std::memcpy(sums, &acc[i][j], sizeof(Vec));
+                for (int w = V / 2; w > 0; w /= 2) {
+                    for (int k = 0; k < w; k++) { sums[k] += sums[k + w]; }
+                }
+                float dot = sums[0];
+                for (int k = k_full; k < K; k++) { dot += a_rows[i][k] * xp[long(j) * K + k]; }
+                float& yv = y[long(m + i) * ldy + j];
+                yv = beta != 0.0f ? alpha * dot + beta * yv : alpha * dot;
+            }
+        }
+    }
+}
+
+template <class Vec, int ACCS>
+__attribute__((always_inline)) inline
+void gemv_rows_body(int NV, int m0, int m1, int K, const float* __restrict__ A, int lda, const float* __restrict__ xp,
+                    float alpha, float beta, float* __restrict__ y, int ldy) {
+    switch (NV) {
+    case 1: gemv_rows_n<Vec, 1, ACCS>(m0, m1, K, A, lda, xp, alpha, beta, y, ldy); break;
+    case 2: gemv_rows_n<Vec, 2, ACCS>(m0, m1, K, A, lda, xp, alpha, beta, y, ldy); break;
+    case 3: gemv_rows_n<Vec, 3, ACCS>(m0, m1, K, A, lda, xp, alpha, beta, y, ldy); break;
+    default: gemv_rows_n<Vec, 4, ACCS>(m0, m1, K, A, lda, xp, alpha, beta, y, ldy); break;
+    }
+}
+
+// The register budgets for partial sums: 16 zmm of 32, 12 ymm of 16 and 12 xmm of 16, which leave room for the
+// vectors of x and the row of A. Each sum is one native register: a vfloat16 split into ymm or xmm halves is
+// kept in memory. As for the fixed shapes, the wrappers leave out __restrict__
+TARGET_AVX512
+void gemv_rows_avx512(int NV, int m0, int m1, int K, const float* A, int lda, const float* xp, float alpha, float beta,
+                      float* y, int ldy) {
+    gemv_rows_body<vfloat16, 16>(NV, m0, m1, K, A, lda, xp, alpha, beta, y, ldy);
+}
+
+TARGET_AVX2
+void gemv_rows_avx2(int NV, int m0, int m1, int K, const float* A, int lda, const float* xp, float alpha, float beta,
+                    float* y, int ldy) {
+    gemv_rows_body<vfloat8, 12>(NV, m0, m1, K, A, lda, xp, alpha, beta, y, ldy);
+}
+
+TARGET_SSE
+void gemv_rows_sse(int NV, int m0, int m1, int K, const float* A, int lda, const float* xp, float alpha, float beta,
+                   float* y, int ldy) {
+    gemv_rows_body<vfloat4, 12>(NV, m0, m1, K, A, lda, xp, alpha, beta, y, ldy);
+}
+
+void gemv_rows_generic(int NV, int m0, int m1, int K, const float* A, int lda, const float* xp, float alpha, float beta,
+                       float* y, int ldy) {
+    gemv_rows_body<vfloat4, 12>(NV, m0, m1, K, A, lda, xp, alpha, beta, y, ldy);
+}
+
+void gemv_rows(int NV, int m0, int m1, int K, const float* A, int lda, const float* xp, float alpha, float beta, float* y,
+               int ldy) {
+    // Rows m0 .. m1 of y = alpha * A * x + beta * y for a row-major A ~ M x K, on the ISA of kernel_info()
+    static void (*const kernels[4])(int, int, int, int, const float*, int, const float*, float, float, float*, int) = {
+        gemv_rows_generic, gemv_rows_sse, gemv_rows_avx2, gemv_rows_avx512 };
+    kernels[int(kernel_info().isa)](NV, m0, m1, K, A, lda, xp, alpha, beta, y, ldy);
+}
+
+template <int NV>
+__attribute__((always_inline)) inline
+void gemv_cols_n(int cols, int K, const float* __restrict__ A, int lda, const float* __restrict__ xp, float alpha,
+                 float beta, float* __restrict__ y, int ldy) {
+    // y[i, j] = alpha * a[i, :] . x_j + beta * y[i, j] for the columns i < cols <= GEMV_CHUNK of an aT layout A ~ K x M
+    // and the NV vectors x_j = xp[j * K ..]. The rows of A are streamed whole, 4 at a time: each pass over the
+    // chunk's accumulators adds 4 rows scaled by their x, so the accumulators are loaded and stored once per 4 rows
+    constexpr int C = GEMV_CHUNK;
+    alignas(64) float acc[NV][C] = {};
+    int k = 0;
+    for (; k + 4 <= K; k += 4) {
+        const float* __restrict__ a0 = A + long(k) * lda;
+        const float* __restrict__ a1 = a0 + lda;
+        const float* __restrict__ a2 = a1 + lda;
+        const float* __restrict__ a3 = a2 + lda;
+        float x0[NV], x1[NV], x2[NV], x3[NV];
+        for (int j = 0; j < NV; j++) {
+            x0[j] = xp[long(j) * K + k];
+            x1[j] = xp[long(j) * K + k + 1];
+            x2[j] = xp[long(j) * K + k + 2];
+            x3[j] = xp[long(j) * K + k + 3];
+        }
+        for (int i = 0; i < cols; i++) {
+            for (int j = 0; j < NV; j++) {
+                acc[j][i] += x0[j] * a0[i] + x1[j] * a1[i] + x2[j] * a2[i] + x3[j] * a3[i];
+            }
+        }
+    }
+    for (; k < K; k++) {
+        const float* __restrict__ a0 = A + long(k) * lda;
+        for (int j = 0; j < NV; j++) {
+            const float x0 = xp[long(j) * K + k];
+            for (int i = 0; i < cols; i++) { acc[j][i] += x0 * a0[i]; }
+        }
+    }
+    for (int i = 0; i < cols; i++) {
+        for (int j = 0; j < NV; j++) {
+            float& yv = y[long(i) * ldy + j];
+            yv = beta != 0.0f ? alpha * acc[j][i] + beta * yv : alpha * acc[j][i];
+        }
+    }
+}
+
+MULTIVERSION
+void gemv_cols(int NV, int m0, int m1, int K, const float* __restrict__ A, int lda, const float* __restrict__ xp, float alpha,
+               float beta, float* __restrict__ y, int ldy) {
+    // Rows m0 .. m1 of y = alpha * A * x + beta * y for A ~ M x K given as aT ~ K x M, in chunks of GEMV_CHUNK
+    for (int m = m0; m < m1; m += GEMV_CHUNK) {
+        int cols = std::min(GEMV_CHUNK, m1 - m);
+        const float* a = A + m;
+        float* ym = y + long(m) * ldy;
+        // A full chunk passes its width as a constant, which the vectorizer needs
+        auto chunk = [&](auto nv) {
+            if (cols == GEMV_CHUNK) {
+                gemv_cols_n<nv>(GEMV_CHUNK, K, a, lda, xp, alpha, beta, ym, ldy);
+            } else {
+                gemv_cols_n<nv>(cols, K, a, lda, xp, alpha, beta, ym, ldy);
+            }
+        };
+        switch (NV) {
+        case 1: chunk(std::integral_constant<int, 1>()); break;
+        case 2: chunk(std::integral_constant<int, 2>()); break;
+        case 3: chunk(std::integral_constant<int, 3>()); break;
+        default: chunk(std::integral_constant<int, 4>()); break;
+        }
+    }
+}
+
+void gemv_on_pool(char transA, char transB, int M, int N, int K, float alpha, const float* __restrict__ A, int lda,
+                  const float* __restrict__ B, int ldb, float beta, float* __restrict__ C, int ldc) {
+    // sgemm for N <= GEMV_MAX_N, a matrix-vector product bound by the bandwidth at which A is read: packing A and
+    // the microkernel's tiles would only add traffic, so A is streamed once in its own layout for all N columns,
+    // which are copied into contiguous vectors first. The rows of C are split into TILES_PER_WORKER runs per worker
+    // on the pool, in whole cache lines of an aT layout A, unless A is too small to pay for it
+    assert(transA == 'N' || transA == 'T');
+    assert(transB == 'N' || transB == 'T');
+    assert(N <= GEMV_MAX_N);
+    if (M <= 0 || N <= 0) { return; }
+    if (K <= 0 || alpha == 0.0f) {
+        scale_matrix(M, N, beta, C, ldc);
+        return;
+    }
+    aligned_vector xp(std::size_t(N) * K);
+    for (int j = 0; j < N; j++) {
+        for (int k = 0; k < K; k++) {
+            xp[long(j) * K + k] = transB == 'N' ? B[long(k) * ldb + j] : B[long(j) * ldb + k];
+        }
+    }
+    WorkStealingPool& pool = WorkStealingPool::instance();
+    int unit = transA == 'T' ? CACHE_LINE_FLOATS : GEMV_ROWS;
+    int units = (M + unit - 1) / unit;
+    int tasks = long(M) * K < PARALLEL_PACK_MIN ? 1 : std::min(units, TILES_PER_WORKER * pool.size());
+    pool.run(tasks, [&](int t, int) {
+        int m0 = split_point(M, tasks, t, unit), m1 = split_point(M, tasks, t + 1, unit);
+        if (m0 == m1) { return; }
+        if (transA == 'T') {
+            gemv_cols(N, m0, m1, K, A, lda, xp.data(), alpha, beta, C, ldc);
+        } else {
+            gemv_rows(N, m0, m1, K, A, lda, xp.data(), alpha, beta, C, ldc);
+        }
+    });
+}
+
+void sgemv(char transA, int M, int K, float alpha, const float* __restrict__ A, int lda, const float* __restrict__ x, float beta,
+           float* __restrict__ y) {
+    // y = alpha * op(A) * x + beta * y for op(A) ~ M x K in the layouts of sgemm and contiguous x ~ K, y ~ M
+    gemv_on_pool(transA, 'N', M, 1, K, alpha, A, lda, x, 1, beta, y, 1);
+}
+
+void sgemm(char transA, char transB, int M, int N, int K, float alpha, const float* __restrict__ A, int lda,
+           const float* __restrict__ B, int ldb, float beta, float* __restrict__ C, int ldc, const Epilogue& ep,
+           const BlockSizes& bs) {
+    // C = alpha * op(A) * op(B) + beta * C with row-major storage, op(A) ~ M x K and op(B) ~ K x N.
+    // transA = 'N': A ~ M x K, a[m, k] = A[m * lda + k]; 'T': A ~ K x M, a[m, k] = A[k * lda + m] (aT).
+    // transB = 'N': B ~ K x N, b[k, n] = B[k * ldb + n]; 'T': B ~ N x K, b[k, n] = B[n * ldb + k] (bT).
+    // The leading dimensions let any submatrix be used in place, ep is fused into the stores of C
+    gemm_on_pool(transA, transB, M, N, K, alpha, A, lda, B, ldb, beta, C, ldc, ep, bs);
+}
+
+void sgemm(char transA, char transB, int M, int N, int K, float alpha, const float* __restrict__ A, int lda,
+           const float* __restrict__ B, int ldb, float beta, float* __restrict__ C, int ldc, const Epilogue& ep) {
+    // sgemm with a fused epilogue and the tuned or default cache blocking
+    sgemm(transA, transB, M, N, K, alpha, A, lda, B, ldb, beta, C, ldc, ep, tuned_blocks(M, K, N));
+}
+
+void sgemm(char transA, char transB, int M, int N, int K, float alpha, const float* __restrict__ A, int lda,
+           const float* __restrict__ B, int ldb, float beta, float* __restrict__ C, int ldc) {
+    // sgemm with the tuned or default cache blocking, or on the GEMV engine when C has at most GEMV_MAX_N columns
+    if (N <= GEMV_MAX_N) {
+        gemv_on_pool(transA, transB, M, N, K, alpha, A, lda, B, ldb, beta, C, ldc);
+        return;
+    }
+    sgemm(transA, transB, M, N, K, alpha, A, lda, B, ldb, beta, C, ldc, Epilogue(), tuned_blocks(M, K, N));
+}
+
+void dgemm(char transA, char transB, int M, int N, int K, double alpha, const double* __restrict__ A, int lda,
+           const double* __restrict__ B, int ldb, double beta, double* __restrict__ C, int ldc, const BlockSizes& bs) {
+    // sgemm in double precision, on the double instantiations of the microkernels
+    gemm_on_pool(transA, transB, M, N, K, alpha, A, lda, B, ldb, beta, C, ldc, Epilogue(), bs);
+}
+
+void dgemm(char transA, char transB, int M, int N, int K, double alpha, const double* __restrict__ A, int lda,
+           const double* __restrict__ B, int ldb, double beta, double* __restrict__ C, int ldc) {
+    // dgemm with the default cache blocking for doubles
+    dgemm(transA, transB, M, N, K, alpha, A, lda, B, ldb, beta, C, ldc, default_blocks<double>());
+}
+
+void hgemm(char transA, char transB, int M, int N, int K, float alpha, const half* __restrict__ A, int lda,
+           const half* __restrict__ B, int ldb, float beta, float* __restrict__ C, int ldc) {
+    // sgemm for fp16 A and B: half the memory traffic for the operands, widened to fp32 while packing and
+    // accumulated in fp32 by the sgemm microkernels
+    gemm_on_pool(transA, transB, M, N, K, alpha, A, lda, B, ldb, beta, C, ldc, Epilogue(), tuned_blocks(M, K, N));
+}
+
+void hgemm(char transA, char transB, int M, int N, int K, float alpha, const half* __restrict__ A, int lda,
+           const half* __restrict__ B, int ldb, float beta, half* __restrict__ C, int ldc) {
+    // hgemm with fp16 C as well, rounded once from the fp32 result
+    gemm_on_pool(transA, transB, M, N, K, alpha, A, lda, B, ldb, beta, C, ldc, Epilogue(), tuned_blocks(M, K, N));
+}
+
+bool has_avx512_bf16() {
+    // vdpbf16ps goes with the AVX-512 microkernel's tile, so TVM_LEARN_ISA below avx512 selects the emulation
+    static const bool bf16 = __builtin_cpu_supports("avx512bf16") && kernel_info().isa == Isa::avx512;
+    return bf16;
+}
+
+MULTIVERSION
+void pack_bf16_pairs(int kc, int width, const bf16* __restrict__ src, long k_stride, long j_stride,
+                     uint32_t* __restrict__ dst, int w) {
+    // The operand layout of vdpbf16ps: dst[k / 2 * w + j] holds the elements (k, j) and (k + 1, j) of src in its
+    // low and high half, where element (k, j) is src[k * k_stride + j * j_stride]. An odd kc is padded with a zero
+    // k, and the columns from width to w with zeros. Rows of unit stride get a loop of their own to vectorize
+    for (int k = 0; k < kc; k += 2) {
+        const bf16* row0 = src + k * k_stride;
+        const bf16* row1 = k + 1 < kc ? row0 + k_stride : nullptr;
+        uint32_t* d = dst + k / 2 * w;
+        if (j_stride == 1 && row1) {
+            for (int j = 0; j < width; j++) {
+                d[j] = row0[j].bits | uint32_t(row1[j].bits) << 16;
+            }
+        } else {
+            for (int j = 0; j < width; j++) {
+                d[j] = row0[j * j_stride].bits | (row1 ? uint32_t(row1[j * j_stride].bits) << 16 : 0);
+            }
+        }
+        for (int j = width; j < w; j++) {
+            d[j] = 0;
+        }
+    }
+}
+
+template <int ROWS>
+TARGET_AVX512_BF16
+void micro_tile_avx512_bf16(int K2, const uint32_t* __restrict__ a, const uint32_t* __restrict__ b, float* __restrict__ c,
+                            int ldc, __mmask16 mask0, __mmask16 mask1, float alpha, float beta) {
+    // ROWS x 32 tile of c = alpha * a * b + beta * c from K2 pairs of k: a holds 8 pairs per k pair, b 32
+    __m512 acc[ROWS][2];
+#pragma GCC unroll 8
+    for (int i = 0; i < ROWS; i++) {
+        acc[i][0] = _mm512_setzero_ps();
+        acc[i][1] = _mm512_setzero_ps();
+    }
+
+    for (int k = 0; k < K2; k++) {
+        __m512bh b0 = (__m512bh)_mm512_loadu_si512(b + k * 32);
+        __m512bh b1 = (__m512bh)_mm512_loadu_si512(b + k * 32 + 16);
+#pragma GCC unroll 8
+        for (int i = 0; i < ROWS; i++) {
+            __m512bh ai = (__m512bh)_mm512_set1_epi32(int(a[k * 8 + i]));
+            acc[i][0] = _mm512_dpbf16_ps(acc[i][0], ai, b0);
+            acc[i][1] = _mm512_dpbf16_ps(acc[i][1], ai, b1);
+        }
+    }
+
+    __m512 valpha = _mm512_set1_ps(alpha), vbeta = _mm512_set1_ps(beta);
+#pragma GCC unroll 8
+    for (int i = 0; i < ROWS; i++) {
+        acc[i][0] = _mm512_mul_ps(valpha, acc[i][0]);
+        acc[i][1] = _mm512_mul_ps(valpha, acc[i][1]);
+        if (beta != 0.0f) {
+            acc[i][0] = _mm512_fmadd_ps(vbeta, _mm512_maskz_loadu_ps(mask0, c + i * ldc), acc[i][0]);
+            acc[i][1] = _mm512_fmadd_ps(vbeta, _mm512_maskz_loadu_ps(mask1, c + i * ldc + 16), acc[i][1]);
+        }
+        _mm512_mask_storeu_ps(c + i * ldc, mask0, acc[i][0]);
+        _mm512_mask_storeu_ps(c + i * ldc + 16, mask1, acc[i][1]);
+    }
+}
+
+void micro_kernel_avx512_bf16(int K2, const uint32_t* __restrict__ a, const uint32_t* __restrict__ b, float* __restrict__ c,
+                              int ldc, int mr, int nr, float alpha, float beta) {
+    // The 8 x 32 tile of micro_kernel_avx512, with two bf16 products per vdpbf16ps lane and alpha applied at the
+    // store, since bf16 operands pre-scaled by alpha would be rounded again
+    using Tile = decltype(&micro_tile_avx512_bf16<8>);
+    static const Tile tiles[] = { nullptr, micro_tile_avx512_bf16<1>, micro_tile_avx512_bf16<2>, micro_tile_avx512_bf16<3>,
+                                  micro_tile_avx512_bf16<4>, micro_tile_avx512_bf16<5>, micro_tile_avx512_bf16<6>,
+                                  micro_tile_avx512_bf16<7>, micro_tile_avx512_bf16<8> };
+    __mmask16 mask0 = nr >= 16 ? 0xFFFF : (1u << nr) - 1;
+    __mmask16 mask1 = nr >= 32 ? 0xFFFF : nr <= 16 ? 0 : (1u << (nr - 16)) - 1;
+    tiles[mr](K2, a, b, c, ldc, mask0, mask1, alpha, beta);
+}
+
+void bf16gemm_avx512(char transA, char transB, int M, int N, int K, float alpha, const bf16* __restrict__ A, int lda,
+                     const bf16* __restrict__ B, int ldb, float beta, float* __restrict__ C, int ldc, const BlockSizes& bs) {
+    // bf16gemm with vdpbf16ps, scheduled like gemm_on_pool: op(B) is packed once into pair panels by pool tasks,
+    // then macro-tile tasks pack their strips of op(A) and run the bf16 microkernel. kc is rounded up to even,
+    // so that every K slab but the last starts a new pair
+    constexpr int MR = 8, NR = 32;
+    assert(bs.mc % MR == 0 && bs.nc % NR == 0);
+    int kc_max = bs.kc + (bs.kc & 1);
+    WorkStealingPool& pool = WorkStealingPool::instance();
+    long a_k = transA == 'T' ? lda : 1, a_m = transA == 'T' ? 1 : lda;
+    long b_k = transB == 'N' ? ldb : 1, b_n = transB == 'N' ? 1 : ldb;
+
+    // Packed op(B): the slab starting at row pc is pb[pc / 2 * n_pad + p * (kc + 1) / 2 * NR], panel p holding
+    // columns p * NR ...
+    int panels = (N + NR - 1) / NR;
+    int n_pad = panels * NR;
+    int slabs = (K + kc_max - 1) / kc_max;
+    std::vector<uint32_t, AlignedAllocator<uint32_t>> pb(std::size_t(K + 1) / 2 * n_pad);
+    pool.run(slabs * panels, [&](int t, int) {
+        int pc = t / panels * kc_max, p = t % panels;
+        int kc = std::min(kc_max, K - pc), kc2 = (kc + 1) / 2, width = std::min(NR, N - p * NR);
+        pack_bf16_pairs(kc, width, B + pc * b_k + p * NR * b_n, b_k, b_n, pb.data() + long(pc / 2) * n_pad + long(p) * kc2 * NR,
+                        NR);
+    });
+
+    int tile_m, tile_n;
+    macro_tiles(M, N, MR, NR, bs, TILES_PER_WORKER * pool.size(), tile_m, tile_n);
+    int tiles_n = (N + tile_n - 1) / tile_n;
+    int tiles = (M + tile_m - 1) / tile_m * tiles_n;
+    std::vector<std::vector<uint32_t, AlignedAllocator<uint32_t>>> pa(pool.size());
+    pool.run(tiles, [&](int t, int w) {
+        int m0 = t / tiles_n * tile_m, m1 = std::min(M, m0 + tile_m);
+        int n0 = t % tiles_n * tile_n, n1 = std::min(N, n0 + tile_n);
+        auto& pa_w = pa[w];
+        if (pa_w.empty()) { pa_w.resize(std::size_t(tile_m) * kc_max / 2); }
+        for (int pc = 0; pc < K; pc += kc_max) {
+            int kc = std::min(kc_max, K - pc), kc2 = (kc + 1) / 2;
+            for (int ir = 0; ir < m1 - m0; ir += MR) {
+                pack_bf16_pairs(kc, std::min(MR, m1 - m0 - ir), A + pc * a_k + (m0 + ir) * a_m, a_k, a_m,
+                                pa_w.data() + long(ir) * kc2, MR);
+            }
+            const uint32_t* pb_slab = pb.data() + long(pc / 2) * n_pad;
+            float beta_slab = pc > 0 ? 1.0f : beta;
+            for (int jr = n0; jr < n1; jr += NR) {
+                for (int ir = 0; ir < m1 - m0; ir += MR) {
+                    micro_kernel_avx512_bf16(kc2, pa_w.data() + ir * kc2, pb_slab + long(jr / NR) * kc2 * NR,
+                                             C + long(m0 + ir) * ldc + jr, ldc, std::min(MR, m1 - m0 - ir),
+                                             std::min(NR, n1 - jr), alpha, beta_slab);
+                }
+            }
+        }
+    });
+}
+
+void bf16gemm_emulated(char transA, char transB, int M, int N, int K, float alpha, const bf16* __restrict__ A, int lda,
+                       const bf16* __restrict__ B, int ldb, float beta, float* __restrict__ C, int ldc) {
+    // bf16gemm on any CPU: the operands are widened to fp32 by shifts while packing, for the fp32 microkernels
+    gemm_on_pool(transA, transB, M, N, K, alpha, A, lda, B, ldb, beta, C, ldc, Epilogue(), tuned_blocks(M, K, N));
+}
+
+void bf16gemm(char transA, char transB, int M, int N, int K, float alpha, const bf16* __restrict__ A, int lda,
+              const bf16* __restrict__ B, int ldb, float beta, float* __restrict__ C, int ldc) {
+    // C = alpha * op(A) * op(B) + beta * C, as sgemm, for bf16 A and B and fp32 accumulation and C. Uses the
+    // AVX512_BF16 dot products if the CPU has them and the emulation otherwise
+    assert(transA == 'N' || transA == 'T');
+    assert(transB == 'N' || transB == 'T');
+    if (M <= 0 || N <= 0) { return; }
+    if (K <= 0 || alpha == 0.0f) {
+        scale_matrix(M, N, beta, C, ldc);
+        return;
+    }
+    if (has_avx512_bf16()) {
+        bf16gemm_avx512(transA, transB, M, N, K, alpha, A, lda, B, ldb, beta, C, ldc, tuned_blocks(M, K, N));
+    } else {
+        bf16gemm_emulated(transA, transB, M, N, K, alpha, A, lda, B, ldb, beta, C, ldc);
+    }
+}
+
+struct Quantization {
+    // The affine quantization of qgemm. The real values of the operands are
+    // a[m, k] = a_scale[m] * (A[m, k] - a_zero) and b[k, n] = b_scale[n] * (B[k, n] - b_zero): per row of A
+    // (per token) and per output channel. A null scale is 1. The int8 C of a requantizing qgemm holds
+    // clamp(round(c / c_scale) + c_zero, -128, 127)
+    const float* a_scale = nullptr;
+    int a_zero = 0;
+    const float* b_scale = nullptr;
+    int b_zero = 0;
+    float c_scale = 1.0f;
+    int c_zero = 0;
+};
+
+// The int8 microkernel computes c[0:mr, 0:nr] (=, or += if accumulate) a * b in int32 for K4 groups of four k:
+// a[k4 * MR + i] holds the four u8 of row i and b[k4 * NR + j] the four s8 of column j, as pack_int8_quads
+// lays them out, so that one vpdpbusd lane takes one group. Only c is bounded by mr and nr, the packed
+// operands are zero-padded to the full tile
+using Int8MicroKernel = void (*)(int K4, const uint32_t* __restrict__ a, const uint32_t* __restrict__ b,
+                                 int32_t* __restrict__ c, int ldc, int mr, int nr, bool accumulate);
+
+struct Int8KernelInfo {
+    const char* name;
+    int mr;
+    int nr;
+    Int8MicroKernel ukernel;
+};
+
+template <class T>
+void pack_int8_quads(int kc, int width, const T* __restrict__ src, long k_stride, long j_stride,
+                     uint32_t* __restrict__ dst, int w, int32_t* __restrict__ sums) {
+    // The operand layout of vpdpbusd: byte q of dst[k / 4 * w + j] is element (k + q, j) of src, which is
+    // src[k * k_stride + j * j_stride]. kc is padded to a multiple of 4 and the columns from width to w with
+    // zeros. A non-null sums[j] gets the sum of column j added, for the zero-point compensation
+    for (int k = 0; k < kc; k += 4) {
+        uint32_t* d = dst + k / 4 * w;
+        for (int j = 0; j < width; j++) {
+            uint32_t quad = 0;
+            int32_t sum = 0;
+            for (int q = 0; q < 4 && k + q < kc; q++) {
+                T v = src[(k + q) * k_stride + j * j_stride];
+                quad |= uint32_t(uint8_t(v)) << (8 * q);
+                sum += v;
+            }
+            d[j] = quad;
+            if (sums) { sums[j] += sum; }
+        }
+        for (int j = width; j < w; j++) {
+            d[j] = 0;
+        }
+    }
+}
+
+template <int ROWS>
+TARGET_AVX512_VNNI
+void int8_tile_avx512_vnni(int K4, const uint32_t* __restrict__ a, const uint32_t* __restrict__ b, int32_t* __restrict__ c,
+                           int ldc, __mmask16 mask0, __mmask16 mask1, bool accumulate) {
+    // ROWS x 32 tile of c in zmm accumulators, four u8 x s8 products per vpdpbusd lane
+    __m512i acc[ROWS][2];
+#pragma GCC unroll 8
+    for (int i = 0; i < ROWS; i++) {
+        acc[i][0] = accumulate ? _mm512_maskz_loadu_epi32(mask0, c + i * ldc) : _mm512_setzero_si512();
+        acc[i][1] = accumulate ? _mm512_maskz_loadu_epi32(mask1, c + i * ldc + 16) : _mm512_setzero_si512();
+    }
+
+    for (int k = 0; k < K4; k++) {
+        __m512i b0 = _mm512_loadu_si512(b + k * 32);
+        __m512i b1 = _mm512_loadu_si512(b + k * 32 + 16);
+#pragma GCC unroll 8
+        for (int i = 0; i < ROWS; i++) {
+            __m512i ai = _mm512_set1_epi32(int(a[k * 8 + i]));
+            acc[i][0] = _mm512_dpbusd_epi32(acc[i][0], ai, b0);
+            acc[i][1] = _mm512_dpbusd_epi32(acc[i][1], ai, b1);
+        }
+    }
+
+#pragma GCC unroll 8
+    for (int i = 0; i < ROWS; i++) {
+        _mm512_mask_storeu_epi32(c + i * ldc, mask0, acc[i][0]);
+        _mm512_mask_storeu_epi32(c + i * ldc + 16, mask1, acc[i][1]);
+    }
+}
+
+void int8_kernel_avx512_vnni(int K4, const uint32_t* __restrict__ a, const uint32_t* __restrict__ b, int32_t* __restrict__ c,
+                             int ldc, int mr, int nr, bool accumulate) {
+    // The 8 x 32 tile of micro_kernel_avx512 with vpdpbusd in place of vfmadd231ps
+    using Tile = decltype(&int8_tile_avx512_vnni<8>);
+    static const Tile tiles[] = { nullptr, int8_tile_avx512_vnni<1>, int8_tile_avx512_vnni<2>, int8_tile_avx512_vnni<3>,
+                                  int8_tile_avx512_vnni<4>, int8_tile_avx512_vnni<5>, int8_tile_avx512_vnni<6>,
+                                  int8_tile_avx512_vnni<7>, int8_tile_avx512_vnni<8> };
+    __mmask16 mask0 = nr >= 16 ? 0xFFFF : (1u << nr) - 1;
+    __mmask16 mask1 = nr >= 32 ? 0xFFFF : nr <= 16 ? 0 : (1u << (nr - 16)) - 1;
+    tiles[mr](K4, a, b, c, ldc, mask0, mask1, accumulate);
+}
+
+template <int ROWS>
+TARGET_AVX2
+void int8_tile_avx2(int K4, const uint32_t* __restrict__ a, const uint32_t* __restrict__ b, int32_t* __restrict__ c,
+                    int ldc, __m256i mask0, __m256i mask1, bool accumulate) {
+    // ROWS x 16 tile of c in ymm accumulators. vpmaddubsw adds two u8 x s8 products into an int16, which can
+    // saturate (255 * -128 * 2 < -32768), so b is split into its even and odd k: with one product of each pair
+    // zeroed the int16 is exact, and vpmaddwd by ones widens both halves to int32
+    __m256i acc[ROWS][2];
+#pragma GCC unroll 4
+    for (int i = 0; i < ROWS; i++) {
+        acc[i][0] = accumulate ? _mm256_maskload_epi32(c + i * ldc, mask0) : _mm256_setzero_si256();
+        acc[i][1] = accumulate ? _mm256_maskload_epi32(c + i * ldc + 8, mask1) : _mm256_setzero_si256();
+    }
+
+    const __m256i even = _mm256_set1_epi16(0x00FF), ones = _mm256_set1_epi16(1);
+    for (int k = 0; k < K4; k++) {
+        __m256i b0 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(b + k * 16));
+        __m256i b1 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(b + k * 16 + 8));
+        __m256i b0_even = _mm256_and_si256(b0, even), b0_odd = _mm256_andnot_si256(even, b0);
+        __m256i b1_even = _mm256_and_si256(b1, even), b1_odd = _mm256_andnot_si256(even, b1);
+#pragma GCC unroll 4
+        for (int i = 0; i < ROWS; i++) {
+            __m256i ai = _mm256_set1_epi32(int(a[k * 4 + i]));
+            acc[i][0] = _mm256_add_epi32(acc[i][0], _mm256_madd_epi16(_mm256_maddubs_epi16(ai, b0_even), ones));
+            acc[i][0] = _mm256_add_epi32(acc[i][0], _mm256_madd_epi16(_mm256_maddubs_epi16(ai, b0_odd), ones));
+            acc[i][1] = _mm256_add_epi32(acc[i][1], _mm256_madd_epi16(_mm256_maddubs_epi16(ai, b1_even), ones));
+            acc[i][1] = _mm256_add_epi32(acc[i][1], _mm256_madd_epi16(_mm256_maddubs_epi16(ai, b1_odd), ones));
+        }
+    }
+
+#pragma GCC unroll 4
+    for (int i = 0; i < ROWS; i++) {
+        _mm256_maskstore_epi32(c + i * ldc, mask0, acc[i][0]);
+        _mm256_maskstore_epi32(c + i * ldc + 8, mask1, acc[i][1]);
+    }
+}
+
+TARGET_AVX2
+void int8_kernel_avx2(int K4, const uint32_t* __restrict__ a, const uint32_t* __restrict__ b, int32_t* __restrict__ c,
+                      int ldc, int mr, int nr, bool accumulate) {
+    // A 4 x 16 tile of c in 8 ymm accumulators, leaving registers for the split columns of b
+    using Tile = decltype(&int8_tile_avx2<4>);
+    static const Tile tiles[] = { nullptr, int8_tile_avx2<1>, int8_tile_avx2<2>, int8_tile_avx2<3>, int8_tile_avx2<4> };
+    __m256i lane = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+    __m256i mask0 = _mm256_cmpgt_epi32(_mm256_set1_epi32(nr), lane);
+    __m256i mask1 = _mm256_cmpgt_epi32(_mm256_set1_epi32(nr - 8), lane);
+    tiles[mr](K4, a, b, c, ldc, mask0, mask1, accumulate);
+}
+
+void int8_kernel_generic(int K4, const uint32_t* __restrict__ a, const uint32_t* __restrict__ b, int32_t* __restrict__ c,
+                         int ldc, int mr, int nr, bool accumulate) {
+    // A 4 x 4 tile of c in plain C++
+    constexpr int MR = 4, NR = 4;
+    int32_t acc[MR][NR] = {};
+    for (int k = 0; k < K4; k++) {
+        for (int i = 0; i < MR; i++) {
+            for (int j = 0; j < NR; j++) {
+                uint32_t qa = a[k * MR + i], qb = b[k * NR + j];
+                for (int q = 0; q < 32; q += 8) {
+                    acc[i][j] += int32_t(uint8_t(qa >> q)) * int32_t(int8_t(uint8_t(qb >> q)));
+                }
+            }
+        }
+    }
+    for (int i = 0; i < mr; i++) {
+        for (int j = 0; j < nr; j++) {
+            c[i * ldc + j] = (accumulate ? c[i * ldc + j] : 0) + acc[i][j];
+        }
+    }
+}
+
+std::vector<Int8KernelInfo> int8_kernels() {
+    // Every int8 microkernel the selected ISA can run, best first: vpdpbusd with the AVX-512 one if the CPU has
+    // AVX512_VNNI, then vpmaddubsw, then the generic one
+    std::vector<Int8KernelInfo> kernels;
+    Isa isa = kernel_info().isa;
+    if (isa == Isa::avx512 && __builtin_cpu_supports("avx512vnni")) {
+        kernels.push_back({ "avx512-vnni", 8, 32, int8_kernel_avx512_vnni });
+    }
+    if (isa >= Isa::avx2) { kernels.push_back({ "avx2", 4, 16, int8_kernel_avx2 }); }
+    kernels.push_back({ "generic", 4, 4, int8_kernel_generic });
+    return kernels;
+}
+
+const Int8KernelInfo& int8_kernel_info() {
+    // The int8 microkernel qgemm runs on: the best of int8_kernels()
+    static const Int8KernelInfo info = int8_kernels().front();
+    return info;
+}
+
+BlockSizes int8_block_sizes(const Int8KernelInfo& ki) {
+    // The fp32 block sizes in bytes: kc four times as deep, since a k of the packed operands takes one byte,
+    // and mc and nc rounded to the int8 tile of ki
+    const BlockSizes& fp32 = default_blocks();
+    return BlockSizes{ std::max(ki.mr, fp32.mc / ki.mr * ki.mr), 4 * fp32.kc, std::max(ki.nr, fp32.nc / ki.nr * ki.nr) };
+}
+
+const BlockSizes& int8_blocks() {
+    // The block sizes of qgemm's microkernel
+    static const BlockSizes bs = int8_block_sizes(int8_kernel_info());
+    return bs;
+}
+
+MULTIVERSION
+void requantize_tile(int mr, int nr, const float* __restrict__ src, int lds, float scale, int zero, int8_t* __restrict__ dst,
+                     int ldd) {
+    // dst = clamp(round(src / scale) + zero, -128, 127), rounding halves to even
+    float inv_scale = 1.0f / scale;
+    for (int i = 0; i < mr; i++) {
+        for (int j = 0; j < nr; j++) {
+            float v = std::nearbyint(src[i * lds + j] * inv_scale) + float(zero);
+            dst[long(i) * ldd + j] = int8_t(std::min(127.0f, std::max(-128.0f, v)));
+        }
+    }
+}
+
+template <class TC>
+void qgemm_on_pool(char transA, char transB, int M, int N, int K, const uint8_t* __restrict__ A, int lda,
+                   const int8_t* __restrict__ B, int ldb, const Quantization& q, TC* __restrict__ C, int ldc,
+                   const Epilogue& ep, const Int8KernelInfo& ki, const BlockSizes& bs) {
+    // The engine of qgemm on the int8 microkernel ki, scheduled like gemm_on_pool: op(B) is packed once by pool
+    // tasks, and macro-tile tasks pack their strips of op(A) and sum up int32 tiles in a buffer of their worker.
+    // After the last K slab the tile is compensated for the zero points, dequantized by the scales, put through
+    // ep and stored as fp32 or requantized to int8. Column sums of op(B) (for a_zero) are taken while packing,
+    // per K slab, and row sums of op(A) (for b_zero) while packing the strips
+    assert(transA == 'N' || transA == 'T');
+    assert(transB == 'N' || transB == 'T');
+    constexpr bool int8_c = std::is_same_v<TC, int8_t>;
+    if (M <= 0 || N <= 0) { return; }
+    assert(bs.mc % ki.mr == 0 && bs.nc % ki.nr == 0 && bs.kc % 4 == 0);
+    WorkStealingPool& pool = WorkStealingPool::instance();
+    long a_k = transA == 'T' ? lda : 1, a_m = transA == 'T' ? 1 : lda;
+    long b_k = transB == 'N' ? ldb : 1, b_n = transB == 'N' ? 1 : ldb;
+    int n_unit = std::max(ki.nr, CACHE_LINE_FLOATS);
+    n_unit = n_unit % ki.nr == 0 && n_unit % CACHE_LINE_FLOATS == 0 ? n_unit : ki.nr * CACHE_LINE_FLOATS;
+
+    // Packed op(B): the slab starting at row pc is pb[pc / 4 * n_pad + p * (kc + 3) / 4 * nr], panel p holding
+    // columns p * nr ...
+    int panels = (N + ki.nr - 1) / ki.nr;
+    int n_pad = panels * ki.nr;
+    int slabs = (K + bs.kc - 1) / bs.kc;
+    std::vector<uint32_t, AlignedAllocator<uint32_t>> pb(std::size_t(K + 3) / 4 * n_pad);
+    std::vector<int32_t> b_slab_sums(q.a_zero ? std::size_t(slabs) * N : 0);
+    pool.run(slabs * panels, [&](int t, int) {
+        int pc = t / panels * bs.kc, p = t % panels;
+        int kc = std::min(bs.kc, K - pc), kc4 = (kc + 3) / 4, width = std::min(ki.nr, N - p * ki.nr);
+        int32_t* sums = q.a_zero ? b_slab_sums.data() + long(t / panels) * N + p * ki.nr : nullptr;
+        pack_int8_quads(kc, width, B + pc * b_k + p * ki.nr * b_n, b_k, b_n,
+                        pb.data() + long(pc / 4) * n_pad + long(p) * kc4 * ki.nr, ki.nr, sums);
+    });
+    std::vector<int32_t> b_sums(q.a_zero ? N : 0);
+    for (int s = 0; s < int(b_slab_sums.size()) / std::max(N, 1); s++) {
+        for (int n = 0; n < N; n++) {
+            b_sums[n] += b_slab_sums[long(s) * N + n];
+        }
+    }
+
+    int tile_m, tile_n;
+    macro_tiles(M, N, ki.mr, n_unit, bs, TILES_PER_WORKER * pool.size(), tile_m, tile_n);
+    int tiles_n = (N + tile_n - 1) / tile_n;
+    int tiles = (M + tile_m - 1) / tile_m * tiles_n;
+    struct Worker {
+        std::vector<uint32_t, AlignedAllocator<uint32_t>> pa;
+        std::vector<int32_t> acc, a_sums;
+        std::vector<float> c32;
+    };
+    std::vector<Worker> workers(pool.size());
+    pool.run(tiles, [&](int t, int w) {
+        int m0 = t / tiles_n * tile_m, m1 = std::min(M, m0 + tile_m);
+        int n0 = t % tiles_n * tile_n, n1 = std::min(N, n0 + tile_n);
+        Worker& wk = workers[w];
+        if (wk.pa.empty()) {
+            wk.pa.resize(std::size_t(tile_m) * bs.kc / 4);
+            wk.acc.resize(std::size_t(tile_m) * tile_n);
+            wk.a_sums.resize(tile_m);
+            if (int8_c) { wk.c32.resize(std::size_t(tile_m) * tile_n); }
+        }
+        std::fill(wk.a_sums.begin(), wk.a_sums.end(), 0);
+        // K = 0 has no slab to clear the accumulators
+        if (K <= 0) { std::fill(wk.acc.begin(), wk.acc.end(), 0); }
+        for (int pc = 0; pc < K; pc += bs.kc) {
+            int kc = std::min(bs.kc, K - pc), kc4 = (kc + 3) / 4;
+            for (int ir = 0; ir < m1 - m0; ir += ki.mr) {
+                pack_int8_quads(kc, std::min(ki.mr, m1 - m0 - ir), A + pc * a_k + (m0 + ir) * a_m, a_k, a_m,
+                                wk.pa.data() + long(ir) * kc4, ki.mr, q.b_zero ? wk.a_sums.data() + ir : nullptr);
+            }
+            const uint32_t* pb_slab = pb.data() + long(pc / 4) * n_pad;
+            for (int jr = n0; jr < n1; jr += ki.nr) {
+                for (int ir = 0; ir < m1 - m0; ir += ki.mr) {
+                    ki.ukernel(kc4, wk.pa.data() + ir * kc4, pb_slab + long(jr / ki.nr) * kc4 * ki.nr,
+                               wk.acc.data() + long(ir) * tile_n + jr - n0, tile_n, std::min(ki.mr, m1 - m0 - ir),
+                               std::min(ki.nr, n1 - jr), pc > 0);
+                }
+            }
+        }
+
+        // sum_k (A - a_zero) (B - b_zero) = sum_k A B - a_zero sum_k B - b_zero sum_k A + K a_zero b_zero
+        float* c32;
+        int ld32;
+        if constexpr (int8_c) {
+            c32 = wk.c32.data();
+            ld32 = tile_n;
+        } else {
+            c32 = C + long(m0) * ldc + n0;
+            ld32 = ldc;
+        }
+        for (int i = 0; i < m1 - m0; i++) {
+            int32_t row_offset = K * q.a_zero * q.b_zero - q.b_zero * wk.a_sums[i];
+            float a_scale = q.a_scale ? q.a_scale[m0 + i] : 1.0f;
+            for (int j = 0; j < n1 - n0; j++) {
+                int32_t v = wk.acc[long(i) * tile_n + j] + row_offset - (q.a_zero ? q.a_zero * b_sums[n0 + j] : 0);
+                float b_scale = q.b_scale ? q.b_scale[n0 + j] : 1.0f;
+                c32[long(i) * ld32 + j] = epilogue_scalar(a_scale * b_scale * float(v), ep, m0 + i, n0 + j);
+            }
+        }
+        if (ep.tile_fn) { ep.tile_fn(ep.ctx, m0, n0, m1 - m0, n1 - n0, c32, ld32); }
+        if constexpr (int8_c) {
+            requantize_tile(m1 - m0, n1 - n0, c32, ld32, q.c_scale, q.c_zero, C + long(m0) * ldc + n0, ldc);
+        }
+    });
+}
+
+void qgemm(char transA, char transB, int M, int N, int K, const uint8_t* __restrict__ A, int lda,
+           const int8_t* __restrict__ B, int ldb, const Quantization& q, float* __restrict__ C, int ldc,
+           const Epilogue& ep = Epilogue()) {
+    // C = ep(dequantized op(A) * op(B)) for u8 A and s8 B in the layouts of sgemm, accumulated exactly in int32:
+    // C[m, n] = a_scale[m] * b_scale[n] * sum_k (A[m, k] - a_zero) (B[k, n] - b_zero), then ep
+    qgemm_on_pool(transA, transB, M, N, K, A, lda, B, ldb, q, C, ldc, ep, int8_kernel_info(), int8_blocks());
+}
+
+void qgemm(char transA, char transB, int M, int N, int K, const uint8_t* __restrict__ A, int lda,
+           const int8_t* __restrict__ B, int ldb, const Quantization& q, int8_t* __restrict__ C, int ldc,
+           const Epilogue& ep = Epilogue()) {
+    // qgemm requantized to int8 by c_scale and c_zero, after ep, so that for instance bias and ReLU of the
+    // next layer's input are fused in
+    qgemm_on_pool(transA, transB, M, N, K, A, lda, B, ldb, q, C, ldc, ep, int8_kernel_info(), int8_blocks());
+}
+
+struct GemmWorkspace {
+    // Packing buffers of one thread, grown on demand and reused from one product to the next
+    aligned_vector pa;
+    aligned_vector pb;
+};
+
+void gemm_serial(char transA, char transB, int M, int N, int K, float alpha, const float* __restrict__ A, int lda,
+                 const float* __restrict__ B, int ldb, float beta, float* __restrict__ C, int ldc, const BlockSizes& bs,
+                 GemmWorkspace& ws) {
+    // The sgemm product on the calling thread alone: the five packed loops of gemm_packed_aT for any layout.
+    // Meant for many small products that are parallel among themselves
+    if (M <= 0 || N <= 0) { return; }
+    if (K <= 0 || alpha == 0.0f) {
+        scale_matrix(M, N, beta, C, ldc);
+        return;
+    }
+    const KernelInfo& ki = kernel_info();
+    int mc_max = std::min(bs.mc, (M + ki.mr - 1) / ki.mr * ki.mr);
+    int nc_max = std::min(bs.nc, (N + ki.nr - 1) / ki.nr * ki.nr);
+    int kc_max = std::min(bs.kc, K);
+    if (ws.pa.size() < std::size_t(mc_max) * kc_max) { ws.pa.resize(std::size_t(mc_max) * kc_max); }
+    if (ws.pb.size() < std::size_t(kc_max) * nc_max) { ws.pb.resize(std::size_t(kc_max) * nc_max); }
+
+    for (int jc = 0; jc < N; jc += bs.nc) {
+        int nc = std::min(bs.nc, N - jc);
+        for (int pc = 0; pc < K; pc += bs.kc) {
+            int kc = std::min(bs.kc, K - pc);
+            for (int jr = 0; jr < nc; jr += ki.nr) {
+                pack_op_b(transB, kc, std::min(ki.nr, nc - jr), B, ldb, pc, jc + jr, ws.pb.data() + long(jr) * kc, ki.nr);
+            }
+            float beta_slab = pc > 0 ? 1.0f : beta;
+            for (int ic = 0; ic < M; ic += bs.mc) {
+                int mc = std::min(bs.mc, M - ic);
+                for (int ir = 0; ir < mc; ir += ki.mr) {
+                    pack_op_a(transA, kc, std::min(ki.mr, mc - ir), A, lda, pc, ic + ir, ws.pa.data() + long(ir) * kc,
+                              ki.mr, alpha);
+                }
+                for (int jr = 0; jr < nc; jr += ki.nr) {
+                    for (int ir = 0; ir < mc; ir += ki.mr) {
+                        ki.ukernel(kc, ws.pa.data() + ir * kc, ki.mr, ws.pb.data() + long(jr) * kc, ki.nr,
+                                   C + long(ic + ir) * ldc + jc + jr, ldc, std::min(ki.mr, mc - ir), std::min(ki.nr, nc - jr),
+                                   beta_slab, nullptr);
+                    }
+                }
+            }
+        }
+    }
+}
+
+void sgemm_strided_batched(char transA, char transB, int M, int N, int K, float alpha, const float* __restrict__ A, int lda,
+                           long strideA, const float* __restrict__ B, int ldb, long strideB, float beta, float* __restrict__ C,
+                           int ldc, long strideC, int batch) {
+    // C_i = alpha * op(A_i) * op(B_i) + beta * C_i for i < batch, with A_i = A + i * strideA and so on; a stride
+    // of 0 shares one operand across the batch. A batch that cannot keep the pool busy runs its products one
+    // after another, each parallel inside. Otherwise the products themselves are the parallel tasks,
+    // TILES_PER_WORKER runs of consecutive ones per worker, each computed on one thread with the packing
+    // workspace that thread keeps across products and calls
+    assert(batch >= 0);
+    WorkStealingPool& pool = WorkStealingPool::instance();
+    const BlockSizes& bs = tuned_blocks(M, K, N);
+    if (batch < pool.size()) {
+        for (int i = 0; i < batch; i++) {
+            sgemm(transA, transB, M, N, K, alpha, A + i * strideA, lda, B + i * strideB, ldb, beta, C + i * strideC, ldc);
+        }
+        return;
+    }
+    int tasks = std::min(batch, TILES_PER_WORKER * pool.size());
+    pool.run(tasks, [&](int t, int) {
+        static thread_local GemmWorkspace ws;
+        for (long i = long(batch) * t / tasks; i < long(batch) * (t + 1) / tasks; i++) {
+            gemm_serial(transA, transB, M, N, K, alpha, A + i * strideA, lda, B + i * strideB, ldb, beta, C + i * strideC, ldc,
+                        bs, ws);
+        }
+    });
+}
+
+// sgemm_split_k cuts K into slices of at least this depth, at most SPLIT_K_MAX_SLICES of them and no more than
+// fit SPLIT_K_MAX_FLOATS of partial products. The count depends on the shape only, never on the threads
+constexpr int SPLIT_K_DEPTH = 1024;
+constexpr int SPLIT_K_MAX_SLICES = 64;
+constexpr long SPLIT_K_MAX_FLOATS = 16L * 1024 * 1024;
+
+int split_k_slices(int M, int N, int K) {
+    // Number of K slices sgemm_split_k computes separately for a product of this shape
+    long by_memory = SPLIT_K_MAX_FLOATS / std::max(1L, long(M) * N);
+    return int(std::max(1L, std::min({ long(K / SPLIT_K_DEPTH), long(SPLIT_K_MAX_SLICES), by_memory })));
+}
+
+void sgemm_split_k(char transA, char transB, int M, int N, int K, float alpha, const float* __restrict__ A, int lda,
+                   const float* __restrict__ B, int ldb, float beta, float* __restrict__ C, int ldc,
+                   WorkStealingPool& pool = WorkStealingPool::instance()) {
+    // sgemm for a small C and a deep K, where the macro tiles of C are too few to keep the pool busy: the
+    // split_k_slices(M, N, K) slices of K are the parallel tasks, each summed up over its K range by gemm_serial
+    // into a private M x N buffer. The buffers are then added up in a fixed binary tree, slice i taking slice
+    // i + stride for stride = 1, 2, 4, ..., parallel over rows, and beta is applied by the last step. Every sum is
+    // formed in the same order whichever worker runs it, so C is bitwise the same for any number of threads
+    if (M <= 0 || N <= 0) { return; }
+    if (K <= 0 || alpha == 0.0f) {
+        scale_matrix(M, N, beta, C, ldc);
+        return;
+    }
+    const int slices = split_k_slices(M, N, K);
+    const long size = long(M) * N;
+    const BlockSizes& bs = tuned_blocks(M, (K + slices - 1) / slices, N);
+    aligned_vector partial(std::size_t(slices) * size);
+    pool.run(slices, [&](int s, int) {
+        static thread_local GemmWorkspace ws;
+        // Slice boundaries fall on whole cache lines of K
+        int k0 = split_point(K, slices, s, CACHE_LINE_FLOATS), k1 = split_point(K, slices, s + 1, CACHE_LINE_FLOATS);
+        float* dst = partial.data() + s * size;
+        if (k0 == k1) {
+            std::fill(dst, dst + size, 0.0f);
+            return;
+        }
+        const float* a = transA == 'T' ? A + long(k0) * lda : A + k0;
+        const float* b = transB == 'N' ? B + long(k0) * ldb : B + k0;
+        gemm_serial(transA, transB, M, N, k1 - k0, alpha, a, lda, b, ldb, 0.0f, dst, N, bs, ws);
+    });
+
+    int row_tasks = std::min(M, TILES_PER_WORKER * pool.size());
+    for (int stride = 1; stride < slices; stride *= 2) {
+        int pairs = (slices + 2 * stride - 1) / (2 * stride);
+        pool.run(pairs * row_tasks, [&](int t, int) {
+            int s = t / row_tasks * 2 * stride, r = t % row_tasks;
+            if (s + stride >= slices) { return; }
+            long i0 = long(M) * r / row_tasks * N, i1 = long(M) * (r + 1) / row_tasks * N;
+            float* __restrict__ dst = partial.data() + s * size;
+            const float* __restrict__ src = partial.data() + (s + stride) * size;
+            for (long i = i0; i < i1; i++) { dst[i] += src[i]; }
+        });
+    }
+    pool.run(row_tasks, [&](int r, int) {
+        for (int m = int(long(M) * r / row_tasks); m < int(long(M) * (r + 1) / row_tasks); m++) {
+            for (int n = 0; n < N; n++) {
+                float& cv = C[long(m) * ldc + n];
+                cv = beta != 0.0f ? partial[long(m) * N + n] + beta * cv : partial[long(m) * N + n];
+            }
+        }
+    });
+}
+
+// sgemm_strassen hands products whose smallest dimension is at most this to sgemm, unless --autotune measured
+// this machine's crossover or TVM_LEARN_STRASSEN_CUTOFF sets one
+constexpr int STRASSEN_CUTOFF = 1024;
+
+int strassen_cutoff() {
+    // The cutoff of sgemm_strassen: TVM_LEARN_STRASSEN_CUTOFF, otherwise the tuning file's entry for this CPU and
+    // microkernel, otherwise STRASSEN_CUTOFF
+    if (const char* env = std::getenv("TVM_LEARN_STRASSEN_CUTOFF")) {
+        int cutoff = std::atoi(env);
+        if (cutoff > 0) { return cutoff; }
+        std::cerr << "Ignoring TVM_LEARN_STRASSEN_CUTOFF=" << env << ": expected a positive integer" << std::endl;
+    }
+    const TuningFile& entries = tuning_file();
+    auto it = entries.strassen_cutoffs.find({ cpu_model(), kernel_info().name });
+    return it != entries.strassen_cutoffs.end() && it->second > 0 ? it->second : STRASSEN_CUTOFF;
+}
+
+MULTIVERSION
+void add_rows(int rows, int n, const float* X, int ldx, float sign, const float* Y, int ldy, float* Z, int ldz) {
+    // Z = X + sign * Y over rows rows; Z may be X or Y, so nothing here is __restrict__
+    for (int i = 0; i < rows; i++) {
+        for (int j = 0; j < n; j++) {
+            Z[long(i) * ldz + j] = X[long(i) * ldx + j] + sign * Y[long(i) * ldy + j];
+        }
+    }
+}
+
+void strassen_add(int m, int n, const float* X, int ldx, float sign, const float* Y, int ldy, float* Z, int ldz) {
+    // Z = X + sign * Y for m x n matrices, in row bands on the pool once the matrices are large enough to pay for it
+    WorkStealingPool& pool = WorkStealingPool::instance();
+    int bands = long(m) * n < PARALLEL_PACK_MIN ? 1 : std::min(m, TILES_PER_WORKER * pool.size());
+    if (bands == 1) {
+        add_rows(m, n, X, ldx, sign, Y, ldy, Z, ldz);
+        return;
+    }
+    pool.run(bands, [&](int t, int) {
+        int i0 = long(m) * t / bands, i1 = long(m) * (t + 1) / bands;
+        add_rows(i1 - i0, n, X + long(i0) * ldx, ldx, sign, Y + long(i0) * ldy, ldy, Z + long(i0) * ldz, ldz);
+    });
+}
+
+long strassen_workspace(int m, int k, int n, int cutoff) {
+    // Floats of workspace that strassen_level needs for an m x k x n product: the two temporaries of each level
+    if (std::min({ m, k, n }) <= std::max(cutoff, 1)) { return 0; }
+    int m2 = m / 2, k2 = k / 2, n2 = n / 2;
+    return long(m2) * std::max(k2, n2) + long(k2) * n2 + strassen_workspace(m2, k2, n2, cutoff);
+}
+
+void strassen_level(int m, int k, int n, const float* A, int lda, const float* B, int ldb, float* C, int ldc, int cutoff,
+                    float* ws, int depth, int& levels) {
+    // C = A * B with Strassen-Winograd's 7 half-size products and 15 additions, scheduled as Boyer, Dumas, Pernet
+    // and Zhou ("Memory efficient scheduling of Strassen-Winograd's matrix multiplication algorithm", 2009) so
+    // that besides the quadrants of C only X ~ m/2 x max(k/2, n/2) and Y ~ k/2 x n/2 are needed, taken from ws.
+    // An odd last row, column or k is peeled off and done by sgemm afterwards
+    if (std::min({ m, k, n }) <= std::max(cutoff, 1)) {
+        sgemm('N', 'N', m, n, k, 1.0f, A, lda, B, ldb, 0.0f, C, ldc);
+        return;
+    }
+    levels = std::max(levels, depth + 1);
+    int m2 = m / 2, k2 = k / 2, n2 = n / 2;
+    const float *A11 = A, *A12 = A + k2, *A21 = A + long(m2) * lda, *A22 = A21 + k2;
+    const float *B11 = B, *B12 = B + n2, *B21 = B + long(k2) * ldb, *B22 = B21 + n2;
+    float *C11 = C, *C12 = C + n2, *C21 = C + long(m2) * ldc, *C22 = C21 + n2;
+    float* X = ws;
+    float* Y = X + long(m2) * std::max(k2, n2);
+    float* next = Y + long(k2) * n2;
+    auto product = [&](const float* P, int ldp, const float* Q, int ldq, float* R, int ldr) {
+        strassen_level(m2, k2, n2, P, ldp, Q, ldq, R, ldr, cutoff, next, depth + 1, levels);
+    };
+
+    strassen_add(m2, k2, A11, lda, -1.0f, A21, lda, X, k2);  // S3 = A11 - A21
+    strassen_add(k2, n2, B22, ldb, -1.0f, B12, ldb, Y, n2);  // T3 = B22 - B12
+    product(X, k2, Y, n2, C21, ldc);                         // P7 = S3 T3
+    strassen_add(m2, k2, A21, lda, 1.0f, A22, lda, X, k2);   // S1 = A21 + A22
+    strassen_add(k2, n2, B12, ldb, -1.0f, B11, ldb, Y, n2);  // T1 = B12 - B11
+    product(X, k2, Y, n2, C22, ldc);                         // P5 = S1 T1
+    strassen_add(m2, k2, X, k2, -1.0f, A11, lda, X, k2);     // S2 = S1 - A11
+    strassen_add(k2, n2, B22, ldb, -1.0f, Y, n2, Y, n2);     // T2 = B22 - T1
+    product(X, k2, Y, n2, C12, ldc);                         // P6 = S2 T2
+    strassen_add(m2, k2, A12, lda, -1.0f, X, k2, X, k2);     // S4 = A12 - S2
+    product(X, k2, B22, ldb, C11, ldc);                      // P3 = S4 B22
+    product(A11, lda, B11, ldb, X, n2);                      // P1 = A11 B11
+    strassen_add(m2, n2, X, n2, 1.0f, C12, ldc, C12, ldc);   // U2 = P1 + P6
+    strassen_add(m2, n2, C12, ldc, 1.0f, C21, ldc, C21, ldc);  // U3 = U2 + P7
+    strassen_add(m2, n2, C12, ldc, 1.0f, C22, ldc, C12, ldc);  // U4 = U2 + P5
+    strassen_add(m2, n2, C21, ldc, 1.0f, C22, ldc, C22, ldc);  // U7 = U3 + P5 = C22
+    strassen_add(m2, n2, C12, ldc, 1.0f, C11, ldc, C12, ldc);  // U5 = U4 + P3 = C12
+    strassen_add(k2, n2, Y, n2, -1.0f, B21, ldb, Y, n2);     // T4 = T2 - B21
+    product(A22, lda, Y, n2, C11, ldc);                      // P4 = A22 T4
+    strassen_add(m2, n2, C21, ldc, -1.0f, C11, ldc, C21, ldc);  // U6 = U3 - P4 = C21
+    product(A12, lda, B21, ldb, C11, ldc);                   // P2 = A12 B21
+    strassen_add(m2, n2, X, n2, 1.0f, C11, ldc, C11, ldc);   // U1 = P1 + P2 = C11
+
+    // Dynamic peeling of odd dimensions: the last k adds a rank-1 update to the even part of C, the last column
+    // and row of C are products of their own
+    if (k % 2) { sgemm('N', 'N', 2 * m2, 2 * n2, 1, 1.0f, A + k - 1, lda, B + long(k - 1) * ldb, ldb, 1.0f, C, ldc); }
+    if (n % 2) { sgemm('N', 'N', m, 1, k, 1.0f, A, lda, B + n - 1, ldb, 0.0f, C + n - 1, ldc); }
+    if (m % 2) { sgemm('N', 'N', 1, 2 * n2, k, 1.0f, A + long(m - 1) * lda, lda, B, ldb, 0.0f, C + long(m - 1) * ldc, ldc); }
+}
+
+struct StrassenReport {
+    // What sgemm_strassen did: the levels of recursion, and with compare set, the largest difference to the
+    // classical sgemm, absolute and relative to the largest entry of C
+    int levels = 0;
+    double max_abs_error = 0.0;
+    double max_rel_error = 0.0;
+};
+
+StrassenReport sgemm_strassen(int M, int N, int K, const float* __restrict__ A, int lda, const float* __restrict__ B, int ldb,
+                              float* __restrict__ C, int ldc, int cutoff = 0, bool compare = false) {
+    // C = A * B for row-major A ~ M x K and B ~ K x N, recursing with Strassen-Winograd while all dimensions exceed
+    // cutoff (0: strassen_cutoff()), then on sgemm. Each level saves an eighth of the multiplications for
+    // 15 additions of quarter-size matrices and grows the rounding error, roughly by a factor of 3 per level, so
+    // this is opt-in per call; compare also runs the classical sgemm and reports the difference. The workspace
+    // is kept by the calling thread across calls
+    if (cutoff <= 0) { cutoff = strassen_cutoff(); }
+    StrassenReport report;
+    if (M <= 0 || N <= 0) { return report; }
+    static thread_local aligned_vector ws;
+    long need = strassen_workspace(M, K, N, cutoff);
+    if (long(ws.size()) < need) { ws.resize(need); }
+    strassen_level(M, K, N, A, lda, B, ldb, C, ldc, cutoff, ws.data(), 0, report.levels);
+
+    if (compare) {
+        aligned_vector classical(std::size_t(M) * N);
+        sgemm('N', 'N', M, N, K, 1.0f, A, lda, B, ldb, 0.0f, classical.data(), N);
+        double max_c = 0.0;
+        for (int m = 0; m < M; m++) {
+            for (int n = 0; n < N; n++) {
+                double c = classical[long(m) * N + n];
+                max_c = std::max(max_c, std::abs(c));
+                report.max_abs_error = std::max(report.max_abs_error, std::abs(C[long(m) * ldc + n] - c));
+            }
+        }
+        report.max_rel_error = max_c > 0.0 ? report.max_abs_error / max_c : 0.0;
+    }
+    return report;
+}
+
+struct CsrMatrix {
+    // A sparse M x K matrix in compressed sparse rows: the nonzeros of row m are values[row_ptr[m] .. row_ptr[m + 1])
+    // in the columns col_idx[...], ascending
+    int rows = 0, cols = 0;
+    std::vector<int> row_ptr, col_idx;
+    std::vector<float> values;
+};
+
+CsrMatrix csr_from_aT(const float* __restrict__ aT, int M, int K) {
+    // The nonzeros of a ~ M x K given as aT ~ K x M, the layout the dense variants take
+    CsrMatrix a;
+    a.rows = M;
+    a.cols = K;
+    a.row_ptr.reserve(M + 1);
+    a.row_ptr.push_back(0);
+    for (int m = 0; m < M; m++) {
+        for (int k = 0; k < K; k++) {
+            if (aT[long(k) * M + m] != 0.0f) {
+                a.col_idx.push_back(k);
+                a.values.push_back(aT[long(k) * M + m]);
+            }
+        }
+        a.row_ptr.push_back(int(a.values.size()));
+    }
+    return a;
+}
+
+struct BcsrMatrix {
+    // A sparse M x K matrix in blocked compressed sparse rows: a block row covers ROWS rows of the matrix, and every
+    // ROWS x COLS block holding a nonzero is stored whole, row-major, with the explicit zeros; blocks past the edge
+    // of the matrix are zero-padded. Block row r has the blocks block_ptr[r] .. block_ptr[r + 1], of block columns
+    // block_col[...]
+    static constexpr int ROWS = 4, COLS = 4;
+    int rows = 0, cols = 0;
+    std::vector<int> block_ptr, block_col;
+    std::vector<float> values;
+};
+
+BcsrMatrix bcsr_from_aT(const float* __restrict__ aT, int M, int K) {
+    // The nonzero blocks of a ~ M x K given as aT ~ K x M
+    constexpr int R = BcsrMatrix::ROWS, C = BcsrMatrix::COLS;
+    BcsrMatrix a;
+    a.rows = M;
+    a.cols = K;
+    a.block_ptr.push_back(0);
+    for (int m0 = 0; m0 < M; m0 += R) {
+        for (int k0 = 0; k0 < K; k0 += C) {
+            float block[R * C] = {};
+            bool nonzero = false;
+            for (int r = 0; r < std::min(R, M - m0); r++) {
+                for (int c = 0; c < std::min(C, K - k0); c++) {
+                    block[r * C + c] = aT[long(k0 + c) * M + m0 + r];
+                    nonzero |= block[r * C + c] != 0.0f;
+                }
+            }
+            if (nonzero) {
+                a.block_col.push_back(k0 / C);
+                a.values.insert(a.values.end(), block, block + R * C);
+            }
+        }
+        a.block_ptr.push_back(int(a.block_col.size()));
+    }
+    return a;
+}
+
+// Width of the column strips of c the sparse kernels accumulate in registers: 4 vectors on AVX-512, 8 on AVX2
+constexpr int SPMM_STRIP = 64;
+
+MULTIVERSION
+void spmm_csr_rows(const CsrMatrix& a, int m0, int m1, const float* __restrict__ b, float* __restrict__ c, int N, float alpha,
+                   float beta) {
+    // Rows m0 .. m1 of c = alpha * a * b + beta * c, the sparse counterpart of multiply_v2_aT: each strip of c is
+    // summed up over the nonzeros of its row, each scaling a row strip of b, in a local accumulator that is
+    // stored once
+    const int* __restrict__ col_idx = a.col_idx.data();
+    const float* __restrict__ values = a.values.data();
+    for (int m = m0; m < m1; m++) {
+        int p0 = a.row_ptr[m], p1 = a.row_ptr[m + 1];
+        for (int n1 = 0; n1 < N; n1 += SPMM_STRIP) {
+            int n2_end = std::min(SPMM_STRIP, N - n1);
+            float acc[SPMM_STRIP] = {};
+            if (n2_end == SPMM_STRIP) {
+                for (int p = p0; p < p1; p++) {
+                    const float v = values[p];
+                    const float* b_row = b + long(col_idx[p]) * N + n1;
+                    for (int n2 = 0; n2 < SPMM_STRIP; n2++) {
+                        acc[n2] += v * b_row[n2];
+                    }
+                }
+            } else {
+                for (int p = p0; p < p1; p++) {
+                    const float v = values[p];
+                    const float* b_row = b + long(col_idx[p]) * N + n1;
+                    for (int n2 = 0; n2 < n2_end; n2++) {
+                        acc[n2] += v * b_row[n2];
+                    }
+                }
+            }
+            for (int n2 = 0; n2 < n2_end; n2++) {
+                float& cv = c[long(m) * N + n1 + n2];
+                cv = beta != 0.0f ? alpha * acc[n2] + beta * cv : alpha * acc[n2];
+            }
+        }
+    }
+}
+
+template <int STRIP>
+__attribute__((always_inline)) inline
+void bcsr_strip(const BcsrMatrix& a, int r, const float* __restrict__ b, int N, int n1, int n2_end,
+                float (&acc)[BcsrMatrix::ROWS][STRIP]) {
+    // Accumulates the block row r of a times columns n1 .. n1 + n2_end of b, inlined into each ISA's clone of
+    // spmm_bcsr_rows. n2_end is STRIP but for the fringe strip, and a block reaches past K only in the last block
+    // column
+    constexpr int R = BcsrMatrix::ROWS, C = BcsrMatrix::COLS;
+    const int K = a.cols;
+    const int* __restrict__ block_col = a.block_col.data();
+    const float* __restrict__ values = a.values.data();
+    for (int p = a.block_ptr[r]; p < a.block_ptr[r + 1]; p++) {
+        const float* __restrict__ block = values + long(p) * R * C;
+        int k0 = block_col[p] * C, cols = std::min(C, K - k0);
+        for (int kk = 0; kk < cols; kk++) {
+            const float* __restrict__ b_row = b + long(k0 + kk) * N + n1;
+            for (int i = 0; i < R; i++) {
+                const float v = block[i * C + kk];
+                for (int n2 = 0; n2 < n2_end; n2++) {
+                    acc[i][n2] += v * b_row[n2];
+                }
+            }
+        }
+    }
+}
+
+MULTIVERSION
+void spmm_bcsr_rows(const BcsrMatrix& a, int r0, int r1, const float* __restrict__ b, float* __restrict__ c, int N, float alpha,
+                    float beta) {
+    // Block rows r0 .. r1 of c = alpha * a * b + beta * c: per block, each of the ROWS accumulators of a strip takes
+    // COLS rows of b, so a row strip of b loaded once serves ROWS rows of c and an index is read per ROWS * COLS values
+    constexpr int R = BcsrMatrix::ROWS, STRIP = SPMM_STRIP / 2;
+    for (int r = r0; r < r1; r++) {
+        int rows = std::min(R, a.rows - r * R);
+        for (int n1 = 0; n1 < N; n1 += STRIP) {
+            int n2_end = std::min(STRIP, N - n1);
+            float acc[R][STRIP] = {};
+            if (n2_end == STRIP) {
+                bcsr_strip<STRIP>(a, r, b, N, n1, STRIP, acc);
+            } else {
+                bcsr_strip<STRIP>(a, r, b, N, n1, n2_end, acc);
+            }
+            for (int i = 0; i < rows; i++) {
+                for (int n2 = 0; n2 < n2_end; n2++) {
+                    float& cv = c[long(r * R + i) * N + n1 + n2];
+                    cv = beta != 0.0f ? alpha * acc[i][n2] + beta * cv : alpha * acc[i][n2];
+                }
+            }
+        }
+    }
+}
+
+template <class F>
+void spmm_on_pool(const std::vector<int>& ptr, long work_per_entry, F rows_fn) {
+    // Splits the rows of a sparse matrix with row pointers ptr into runs of about equal nonzero count, TILES_PER_WORKER
+    // per worker, and calls rows_fn(begin, end) for each on the pool; work too small to pay for the pool runs inline
+    int rows = int(ptr.size()) - 1;
+    long nnz = ptr.back();
+    WorkStealingPool& pool = WorkStealingPool::instance();
+    int tasks = nnz * work_per_entry < PARALLEL_PACK_MIN ? 1 : std::min(rows, TILES_PER_WORKER * pool.size());
+    if (tasks <= 1) {
+        rows_fn(0, rows);
+        return;
+    }
+    // Each task takes its rows from the first one whose nonzeros start at or past its share, plus any empty rows
+    // in between, so the runs cover all rows however the nonzeros are spread
+    auto split = [&](int t) {
+        if (t == tasks) { return rows; }
+        return int(std::lower_bound(ptr.begin(), ptr.end() - 1, nnz * t / tasks) - ptr.begin());
+    };
+    pool.run(tasks, [&](int t, int) {
+        int begin = split(t), end = split(t + 1);
+        if (begin < end) { rows_fn(begin, end); }
+    });
+}
+
+void spmm_csr(const CsrMatrix& a, const float* __restrict__ b, float* __restrict__ c, int N, float alpha = 1.0f, float beta = 0.0f) {
+    // c = alpha * a * b + beta * c for a sparse a ~ M x K, dense b ~ K x N and c ~ M x N, parallel over runs of rows
+    // with equal nonzero counts. It does 2 * nnz * N flops against sgemm's 2 * M * K * N, but at a fraction of its
+    // rate since b is streamed per nonzero rather than packed and reused from registers
+    assert(int(a.row_ptr.size()) == a.rows + 1);
+    spmm_on_pool(a.row_ptr, N, [&](int m0, int m1) { spmm_csr_rows(a, m0, m1, b, c, N, alpha, beta); });
+}
+
+void spmm_bcsr(const BcsrMatrix& a, const float* __restrict__ b, float* __restrict__ c, int N, float alpha = 1.0f,
+               float beta = 0.0f) {
+    // c = alpha * a * b + beta * c as spmm_csr, for a blocked a: worth it when the nonzeros cluster in blocks, since
+    // the explicit zeros of a block are multiplied too
+    assert(int(a.block_ptr.size()) == (a.rows + BcsrMatrix::ROWS - 1) / BcsrMatrix::ROWS + 1);
+    spmm_on_pool(a.block_ptr, long(BcsrMatrix::ROWS) * BcsrMatrix::COLS * N,
+                 [&](int r0, int r1) { spmm_bcsr_rows(a, r0, r1, b, c, N, alpha, beta); });
+}
+
+struct Sparse24Matrix {
+    // An M x K matrix pruned to 2:4 structured sparsity: of each group of 4 consecutive elements of a row, at most 2
+    // are nonzero. A row keeps 2 values per group, values[m * 2 * groups + 2 * g + j], and their positions in the
+    // group as 2-bit indices, the two of a group in one nibble and two groups to a byte. A group with fewer than 2
+    // nonzeros is filled with zeros at a valid position; a K that is not a multiple of 4 ends in a shorter group
+    int rows = 0, cols = 0, groups = 0;
+    std::vector<float> values;
+    std::vector<uint8_t> indices;
+
+    int index_bytes() const { return (groups + 1) / 2; }
+};
+
+void prune_2_4_aT(float* __restrict__ aT, int M, int K) {
+    // Prunes a ~ M x K given as aT ~ K x M to 2:4 sparsity in place, keeping the two largest magnitudes of each group
+    for (int m = 0; m < M; m++) {
+        for (int k0 = 0; k0 < K; k0 += 4) {
+            int width = std::min(4, K - k0);
+            int keep[2] = { -1, -1 };
+            for (int kk = 0; kk < width; kk++) {
+                float v = std::abs(aT[long(k0 + kk) * M + m]);
+                if (keep[0] < 0 || v > std::abs(aT[long(k0 + keep[0]) * M + m])) {
+                    keep[1] = keep[0];
+                    keep[0] = kk;
+                } else if (keep[1] < 0 || v > std::abs(aT[long(k0 + keep[1]) * M + m])) {
+                    keep[1] = kk;
+                }
+            }
+            for (int kk = 0; kk < width; kk++) {
+                if (kk != keep[0] && kk != keep[1]) { aT[long(k0 + kk) * M + m] = 0.0f; }
+            }
+        }
+    }
+}
+
+Sparse24Matrix sparse24_from_aT(const float* __restrict__ aT, int M, int K) {
+    // The compressed form of a 2:4 sparse a ~ M x K given as aT ~ K x M; throws if a group has more than 2 nonzeros
+    Sparse24Matrix a;
+    a.rows = M;
+    a.cols = K;
+    a.groups = (K + 3) / 4;
+    a.values.assign(std::size_t(M) * 2 * a.groups, 0.0f);
+    a.indices.assign(std::size_t(M) * a.index_bytes(), 0);
+    for (int m = 0; m < M; m++) {
+        for (int g = 0; g < a.groups; g++) {
+            int k0 = 4 * g, width = std::min(4, K - k0), kept = 0;
+            int index[2] = { 0, 0 };
+            for (int kk = 0; kk < width; kk++) {
+                float v = aT[long(k0 + kk) * M + m];
+                if (v == 0.0f) { continue; }
+                if (kept == 2) {
+                    throw std::runtime_error("sparse24_from_aT: row " + std::to_string(m) + " has more than 2 nonzeros in "
+                                             "columns " + std::to_string(k0) + " .. " + std::to_string(k0 + width - 1));
+                }
+                a.values[(long(m) * a.groups + g) * 2 + kept] = v;
+                index[kept++] = kk;
+            }
+            // Padding zeros point at the other nonzero or the first column of the group, both inside the matrix
+            if (kept == 1) { index[1] = index[0]; }
+            a.indices[long(m) * a.index_bytes() + g / 2] |= uint8_t((index[0] | index[1] << 2) << (g % 2 * 4));
+        }
+    }
+    return a;
+}
+
+template <int R, int STRIP>
+__attribute__((always_inline)) inline
+void sparse24_strip(const Sparse24Matrix& a, int m1, int rows, const float* __restrict__ b, int N, int n1, int n2_end,
+                    float (&acc)[R][STRIP]) {
+    // Accumulates rows m1 .. m1 + rows of a times columns n1 .. n1 + n2_end of b, inlined into each ISA's clone of
+    // spmm_2_4_rows. Per group, every row gathers the 2 rows of b its indices select, so it does 2 of the 4 FMAs
+    // the dense product would; the 4 rows of b of a group are shared by the rows of the tile and stay in L1
+    const int groups = a.groups, index_bytes = a.index_bytes();
+    const float* __restrict__ values = a.values.data() + long(m1) * groups * 2;
+    const uint8_t* __restrict__ indices = a.indices.data() + long(m1) * index_bytes;
+    for (int g = 0; g < groups; g++) {
+        const float* __restrict__ b_group = b + long(4 * g) * N + n1;
+#pragma GCC unroll 4
+        for (int i = 0; i < rows; i++) {
+            const float* __restrict__ v = values + (long(i) * groups + g) * 2;
+            int nibble = indices[long(i) * index_bytes + g / 2] >> (g % 2 * 4);
+            const float* __restrict__ b0 = b_group + long(nibble & 3) * N;
+            const float* __restrict__ b1 = b_group + long(nibble >> 2 & 3) * N;
+            for (int n2 = 0; n2 < n2_end; n2++) {
+                acc[i][n2] += v[0] * b0[n2];
+                acc[i][n2] += v[1] * b1[n2];
+            }
+        }
+    }
+}
+
+MULTIVERSION
+void spmm_2_4_rows(const Sparse24Matrix& a, int m_begin, int m_end, const float* __restrict__ b, float* __restrict__ c,
+                   int N, float alpha, float beta) {
+    // Rows m_begin .. m_end of c = alpha * a * b + beta * c on 4-row tiles of c, column strip by column strip so that
+    // the K x STRIP slab of b a strip reads stays in cache across the tiles. The unrolled rows keep the 4 x STRIP
+    // accumulators in registers: 8 zmm or 16 ymm
+    constexpr int R = 4, STRIP = SPMM_STRIP / 2;
+    for (int n1 = 0; n1 < N; n1 += STRIP) {
+        int n2_end = std::min(STRIP, N - n1);
+        for (int m1 = m_begin; m1 < m_end; m1 += R) {
+            int rows = std::min(R, m_end - m1);
+            float acc[R][STRIP] = {};
+            if (rows == R && n2_end == STRIP) {
+                sparse24_strip<R, STRIP>(a, m1, R, b, N, n1, STRIP, acc);
+            } else {
+                sparse24_strip<R, STRIP>(a, m1, rows, b, N, n1, n2_end, acc);
+            }
+            for (int i = 0; i < rows; i++) {
+                for (int n2 = 0; n2 < n2_end; n2++) {
+                    float& cv = c[long(m1 + i) * N + n1 + n2];
+                    cv = beta != 0.0f ? alpha * acc[i][n2] + beta * cv : alpha * acc[i][n2];
+                }
+            }
+        }
+    }
+}
+
+void spmm_2_4(const Sparse24Matrix& a, const float* __restrict__ b, float* __restrict__ c, int N, float alpha = 1.0f,
+              float beta = 0.0f) {
+    // c = alpha * a * b + beta * c for a 2:4 sparse a ~ M x K, dense b ~ K x N and c ~ M x N, in runs of 4-row tiles
+    // on the pool. With every row holding the same number of nonzeros the runs are equal in work
+    WorkStealingPool& pool = WorkStealingPool::instance();
+    int tiles = (a.rows + 3) / 4;
+    int tasks = long(a.rows) * a.groups * 2 * N < PARALLEL_PACK_MIN ? 1 : std::min(tiles, TILES_PER_WORKER * pool.size());
+    if (tasks <= 1) {
+        spmm_2_4_rows(a, 0, a.rows, b, c, N, alpha, beta);
+        return;
+    }
+    pool.run(tasks, [&](int t, int) {
+        int m0 = 4 * int(long(tiles) * t / tasks), m1 = std::min(a.rows, 4 * int(long(tiles) * (t + 1) / tasks));
+        spmm_2_4_rows(a, m0, m1, b, c, N, alpha, beta);
+    });
+}
+
+// Number of mask entries of a row whose dot products sddmm_rows computes together, sharing each load of the row of a
+constexpr int SDDMM_ENTRIES = 4;
+
+MULTIVERSION
+void sddmm_rows(const CsrMatrix& mask, int m0, int m1, const float* __restrict__ a, const float* __restrict__ bT, int K,
+                float* __restrict__ values) {
+    // Rows m0 .. m1 of values[p] = mask.values[p] * a[m, :] . bT[n, :] for the entries p = (m, n) of the mask. The dot
+    // products are vectorized over K in 16 partial sums each, which are added up at the end, and a row of a is read
+    // once per SDDMM_ENTRIES entries
+    constexpr int E = SDDMM_ENTRIES, V = 16;
+    const int* __restrict__ col_idx = mask.col_idx.data();
+    const float* __restrict__ weights = mask.values.data();
+    const int k_full = K / V * V;
+    for (int m = m0; m < m1; m++) {
+        const float* __restrict__ a_row = a + long(m) * K;
+        for (int p0 = mask.row_ptr[m]; p0 < mask.row_ptr[m + 1]; p0 += E) {
+            int entries = std::min(E, mask.row_ptr[m + 1] - p0);
+            // A short run repeats its last column, whose result is then dropped
+            const float* __restrict__ b_rows[E];
+            for (int e = 0; e < E; e++) { b_rows[e] = bT + long(col_idx[p0 + std::min(e, entries - 1)]) * K; }
+            float acc[E][V] = {};
+            for (int k1 = 0; k1 < k_full; k1 += V) {
+#pragma GCC unroll 4
+                for (int e = 0; e < E; e++) {
+                    for (int k2 = 0; k2 < V; k2++) {
+                        acc[e][k2] += a_row[k1 + k2] * b_rows[e][k1 + k2];
+                    }
+                }
+            }
+            // The partial sums are added up pairwise, halving the vector each step
+            for (int w = V / 2; w > 0; w /= 2) {
+                for (int e = 0; e < E; e++) {
+                    for (int k2 = 0; k2 < w; k2++) { acc[e][k2] += acc[e][k2 + w]; }
+                }
+            }
+            for (int e = 0; e < entries; e++) {
+                float dot = acc[e][0];
+                for (int k = k_full; k < K; k++) { dot += a_row[k] * b_rows[e][k]; }
+                values[p0 + e] = weights[p0 + e] * dot;
+            }
+        }
+    }
+}
+
+void sddmm(const CsrMatrix& mask, const float* __restrict__ a, const float* __restrict__ bT, int K, float* __restrict__ values) {
+    // The sampled dense-dense product: values[p] = mask.values[p] * (a * b)[m, n] for the entries p = (m, n) of an
+    // M x N mask, with a ~ M x K and bT ~ N x K, without computing the rest of a * b. It costs 2 * nnz * K flops,
+    // parallel over runs of mask rows with equal entry counts; a mask of ones gives plain samples of a * b
+    assert(int(mask.row_ptr.size()) == mask.rows + 1);
+    spmm_on_pool(mask.row_ptr, K, [&](int m0, int m1) { sddmm_rows(mask, m0, m1, a, bT, K, values); });
+}
+
+void multiply_v7_aT(const float* __restrict__ aT, const float* __restrict__ b, float* __restrict__ c, int M, int K, int N,
+                    const BlockSizes& bs) {
+    // c = aT * b on the work-stealing pool, i.e. sgemm of the aT * b layout
+    sgemm('T', 'N', M, N, K, 1.0f, aT, M, b, N, 0.0f, c, N, Epilogue(), bs);
+}
+
+constexpr int fixed_tile(int extent, int max_tile) {
+    // The largest tile size up to max_tile that divides extent, so that tiles of it cover extent without a tail
+    for (int t = max_tile; t > 1; t--) {
+        if (extent % t == 0) { return t; }
+    }
+    return 1;
+}
+
+template <int M, int K, int N, int MAX_TM, int MAX_TV>
+__attribute__((always_inline)) inline
+void fixed_shape_body(const float* __restrict__ aT, const float* __restrict__ b, float* __restrict__ c) {
+    // c = aT * b for a shape known at compile time, inlined into a caller for one ISA. The register tile of
+    // TM rows and TV vectors of 16 columns is picked from the divisors of M and N within the register budget
+    // of the caller, so there are no fringe tiles and no tail checks, and K up to 64 is unrolled completely
+    static_assert(N % 16 == 0, "N must be a multiple of the vector width");
+    constexpr int TM = fixed_tile(M, MAX_TM), TV = fixed_tile(N / 16, MAX_TV);
+    for (int m1 = 0; m1 < M; m1 += TM) {
+        for (int n1 = 0; n1 < N; n1 += TV * 16) {
+            vfloat16 acc[TM][TV] = {};
+#pragma GCC unroll 64
+            for (int k = 0; k < K; k++) {
+                vfloat16 bk[TV];
+                for (int v = 0; v < TV; v++) {
+                    std::memcpy(&bk[v], b + k * N + n1 + v * 16, sizeof(vfloat16));
+                }
+                for (int m2 = 0; m2 < TM; m2++) {
+                    float a = aT[k * M + m1 + m2];
+                    for (int v = 0; v < TV; v++) {
+                        acc[m2][v] += a * bk[v];
+                    }
+                }
+            }
+            for (int m2 = 0; m2 < TM; m2++) {
+                for (int v = 0; v < TV; v++) {
+                    std::memcpy(c + (m1 + m2) * N + n1 + v * 16, &acc[m2][v], sizeof(vfloat16));
+                }
+            }
+        }
+    }
+}
+
+// The register budgets: 8 x 2 zmm of 32 and 6 x 2 ymm of 16. Without FMA, 6 x 4 xmm run faster than a tile
+// that fits the 16 xmm, as the independent chains hide the latency of mul + add. The wrappers leave out
+// __restrict__, which the body already has: on the wrapper it makes GCC 12 keep the accumulators in memory
+template <int M, int K, int N>
+TARGET_AVX512
+void multiply_fixed_avx512(const float* aT, const float* b, float* c) {
+    fixed_shape_body<M, K, N, 8, 2>(aT, b, c);
+}
+
+template <int M, int K, int N>
+TARGET_AVX2
+void multiply_fixed_avx2(const float* aT, const float* b, float* c) {
+    fixed_shape_body<M, K, N, 6, 1>(aT, b, c);
+}
+
+template <int M, int K, int N>
+TARGET_SSE
+void multiply_fixed_sse(const float* aT, const float* b, float* c) {
+    fixed_shape_body<M, K, N, 6, 1>(aT, b, c);
+}
+
+template <int M, int K, int N>
+void multiply_fixed_generic(const float* aT, const float* b, float* c) {
+    fixed_shape_body<M, K, N, 6, 1>(aT, b, c);
+}
+
+struct FixedShape {
+    int M;
+    int K;
+    int N;
+    // The instantiations for this shape, indexed by Isa
+    void (*kernels[4])(const float* aT, const float* b, float* c);
+};
+
+template <int M, int K, int N>
+constexpr FixedShape fixed_shape() {
+    // The registry entry of the shape M x K x N
+    return { M, K, N, { multiply_fixed_generic<M, K, N>, multiply_fixed_sse<M, K, N>, multiply_fixed_avx2<M, K, N>,
+                        multiply_fixed_avx512<M, K, N> } };
+}
+
+// The shapes known when building: tiny_test(), attention heads, and small square blocks.
+// A new shape only needs a line here
+const FixedShape fixed_shapes[] = {
+    fixed_shape<3, 2, 16>(),
+    fixed_shape<16, 16, 16>(),
+    fixed_shape<32, 32, 32>(),
+    fixed_shape<64, 64, 64>(),
+};
+
+void multiply_shaped_aT(const float* __restrict__ aT, const float* __restrict__ b, float* __restrict__ c, int M, int K, int N) {
+    // c = aT * b through the instantiation registered for this shape, or through the generic engine for any other
+    for (const FixedShape& shape : fixed_shapes) {
+        if (shape.M == M && shape.K == K && shape.N == N) {
+            shape.kernels[int(kernel_info().isa)](aT, b, c);
+            return;
+        }
+    }
+    sgemm('T', 'N', M, N, K, 1.0f, aT, M, b, N, 0.0f, c, N);
+}
+
+class NumaBuffer {
+    // A page-aligned float buffer that is not written on allocation, so each page lands in the memory of
+    // the NUMA node whose worker touches it first
+public:
+    explicit NumaBuffer(std::size_t n) : size_(n) {
+        std::size_t bytes = (n * sizeof(float) + PAGE - 1) / PAGE * PAGE;
+        data_ = static_cast<float*>(std::aligned_alloc(PAGE, std::max(bytes, PAGE)));
+        if (!data_) { throw std::bad_alloc(); }
+    }
+    NumaBuffer(NumaBuffer&& other) noexcept : data_(other.data_), size_(other.size_) { other.data_ = nullptr; }
+    NumaBuffer(const NumaBuffer&) = delete;
+    NumaBuffer& operator=(const NumaBuffer&) = delete;
+    ~NumaBuffer() { std::free(data_); }
+
+    float* data() { return data_; }
+    const float* data() const { return data_; }
+    std::size_t size() const { return size_; }
+
+    static constexpr std::size_t PAGE = 4096;
+
+private:
+    float* data_;
+    std::size_t size_;
+};
+
+int numa_owner(int i, int size, int nodes, int unit) {
+    // The node owning row (or column) i when size of them are split over the nodes in whole units
+    int d = 0;
+    while (d + 1 < nodes && split_point(size, nodes, d + 1, unit) <= i) { d++; }
+    return d;
+}
+
+void numa_first_touch(float* dst, const float* src, int rows, int cols, bool by_column, int unit) {
+    // Writes the rows x cols matrix src (zeros if src is null) into the page-aligned dst so that every page is
+    // first touched by the workers of a single node: node d owns a contiguous range of rows, or of columns if
+    // by_column is set, and a page goes to the owner of its first element. A page straddling two slices, as
+    // every boundary page of a column split does unless the rows are whole pages, is thus never split
+    constexpr long PAGE_FLOATS = NumaBuffer::PAGE / sizeof(float);
+    WorkStealingPool& pool = WorkStealingPool::instance();
+    int nodes = pool.nodes();
+    int pieces = std::max(1, pool.size() / nodes);
+    long size = long(rows) * cols;
+    long pages = (size + PAGE_FLOATS - 1) / PAGE_FLOATS;
+    pool.run_placed(nodes * pieces, [pieces](int t) { return t / pieces; }, true, [&](int t, int) {
+        int d = t / pieces, piece = t % pieces;
+        // The workers of a node share the pages, each keeping those its node owns
+        for (long page = pages * piece / pieces; page < pages * (piece + 1) / pieces; page++) {
+            long i0 = page * PAGE_FLOATS, i1 = std::min(size, i0 + PAGE_FLOATS);
+            int first = by_column ? int(i0 % cols) : int(i0 / cols);
+            if (numa_owner(first, by_column ? cols : rows, nodes, unit) != d) { continue; }
+            for (long i = i0; i < i1; i++) { dst[i] = src ? src[i] : 0.0f; }
+        }
+    });
+}
+
+void multiply_v7_aT_numa(const float* __restrict__ aT, const float* __restrict__ b, float* __restrict__ c, int M, int K, int N,
+                         const BlockSizes& bs) {
+    // c = aT * b in NUMA mode. Node d owns rows numa_owner(., M, nodes, mr) == d of c and the matching columns
+    // of aT, as placed by numa_first_touch; b is packed once per node by that node's workers, and the
+    // macro-tiles of every node's rows are queued on its workers, which read the packed b of their own node
+    const KernelInfo& ki = kernel_info();
+    WorkStealingPool& pool = WorkStealingPool::instance();
+    int nodes = pool.nodes();
+    int n_unit = std::max(ki.nr, CACHE_LINE_FLOATS);
+    n_unit = n_unit % ki.nr == 0 && n_unit % CACHE_LINE_FLOATS == 0 ? n_unit : ki.nr * CACHE_LINE_FLOATS;
+    if (K <= 0) {
+        scale_matrix(M, N, 0.0f, c, N);
+        return;
+    }
+
+    int panels = (N + ki.nr - 1) / ki.nr;
+    int n_pad = panels * ki.nr;
+    int slabs = (K + bs.kc - 1) / bs.kc;
+    std::vector<NumaBuffer> pb;
+    for (int d = 0; d < nodes; d++) { pb.emplace_back(std::size_t(K) * n_pad); }
+    int per_node = slabs * panels;
+    pool.run_placed(nodes * per_node, [per_node](int t) { return t / per_node; }, true, [&](int t, int) {
+        int d = t / per_node, pc = t % per_node / panels * bs.kc, p = t % panels;
+        int kc = std::min(bs.kc, K - pc);
+        pack_sliver(kc, std::min(ki.nr, N - p * ki.nr), b + long(pc) * N + p * ki.nr, N,
+                    pb[d].data() + long(pc) * n_pad + long(p) * kc * ki.nr, ki.nr, 1.0f);
+    });
+
+    struct Tile {
+        int m0, m1, n0, n1, node;
+    };
+    std::vector<Tile> tiles;
+    for (int d = 0; d < nodes; d++) {
+        int r0 = split_point(M, nodes, d, ki.mr), r1 = split_point(M, nodes, d + 1, ki.mr);
+        if (r0 == r1) { continue; }
+        int tile_m, tile_n;
+        macro_tiles(r1 - r0, N, ki.mr, n_unit, bs, TILES_PER_WORKER * pool.size() / nodes, tile_m, tile_n);
+        for (int m0 = r0; m0 < r1; m0 += tile_m) {
+            for (int n0 = 0; n0 < N; n0 += tile_n) {
+                tiles.push_back({ m0, std::min(r1, m0 + tile_m), n0, std::min(N, n0 + tile_n), d });
+            }
+        }
+    }
+
+    std::vector<aligned_vector> pa(pool.size());
+    pool.run_placed(int(tiles.size()), [&tiles](int t) { return tiles[t].node; }, false, [&](int t, int w) {
+        const Tile& tile = tiles[t];
+        // A tile stolen by another node still reads the packed b local to the thief
+        const float* pb_node = pb[pool.worker_node(w)].data();
+        aligned_vector& pa_w = pa[w];
+        int strips = (tile.m1 - tile.m0 + ki.mr - 1) / ki.mr;
+        pa_w.resize(std::max(pa_w.size(), std::size_t(strips) * ki.mr * bs.kc));
+        for (int pc = 0; pc < K; pc += bs.kc) {
+            int kc = std::min(bs.kc, K - pc);
+            pack_a(tile.m1 - tile.m0, kc, aT + long(pc) * M + tile.m0, M, pa_w.data(), ki.mr, false);
+            const float* pb_slab = pb_node + long(pc) * n_pad;
+            for (int jr = tile.n0; jr < tile.n1; jr += ki.nr) {
+                for (int ir = 0; ir < tile.m1 - tile.m0; ir += ki.mr) {
+                    ki.ukernel(kc, pa_w.data() + ir * kc, ki.mr, pb_slab + long(jr / ki.nr) * kc * ki.nr, ki.nr,
+                               c + long(tile.m0 + ir) * N + jr, N, std::min(ki.mr, tile.m1 - tile.m0 - ir),
+                               std::min(ki.nr, tile.n1 - jr), pc > 0 ? 1.0f : 0.0f, nullptr);
+                }
+            }
+        }
+    });
+}
+
+bool epsilon_equal(float a, float b) {
+    // Equality with the given accuracy, relative to the magnitude of the values: the blocked variants sum
+    // over K in a different order, and entries of c grow with K
+    return std::abs(a - b) < 1e-4 * std::max(1.0f, std::max(std::abs(a), std::abs(b)));
+}
+
+void print_mat(const float* c, int M, int N) {
+    // A function for pretty printing of a matrix
+    for (int i = 0; i < M; i++) {
+        for (int j = 0; j < N; j++) {
+            std::cout << c[i * N + j] << " ";
+        }
+        std::cout << std::endl;
+    }
+    std::cout << std::endl;
+}
+
+void transpose_matr(const float* __restrict__ p, float* __restrict__ pT, int M, int K) {
+    // A function that transposes a matrix
+    for (int i = 0; i < M; i++) {
+        for (int j = 0; j < K; j++) {
+            pT[j * M + i] = p[i * K + j];
+        }
+    }
+}
+
+void bench_numa(const float* aT, const float* b, const std::vector<float>& vc, int M, int K, int N, const BlockSizes& bs) {
+    // NUMA mode: aT and c are first-touched slice by slice on the nodes that own them, then multiplied.
+    // Run with TVM_LEARN_NUMA_NODES=2 to simulate a dual-socket machine on a single node
+    const NumaTopology& topology = numa_topology();
+    int mr = kernel_info().mr;
+    NumaBuffer aT_local(std::size_t(K) * M);
+    NumaBuffer c_local(std::size_t(M) * N);
+    numa_first_touch(aT_local.data(), aT, K, M, true, mr);
+    numa_first_touch(c_local.data(), nullptr, M, N, false, mr);
+
+    double ms = time_ms(20, [&] { multiply_v7_aT_numa(aT_local.data(), b, c_local.data(), M, K, N, bs); });
+    if (!std::equal(vc.begin(), vc.end(), c_local.data(), c_local.data() + c_local.size(), epsilon_equal)) {
+        throw std::runtime_error("c_numa != vc");
+    }
+    std::cout << "Matrix multiplication version 7, NUMA mode (" << topology.nodes() << " nodes"
+              << (topology.simulated ? ", simulated" : "") << "): " << ms << " ms, " << 2.0 * M * N * K / ms * 1e-6
+              << " GFLOP/s" << std::endl;
+}
+
+void bench_tail_latency(const float* aT, const float* b, int M, int K, int N, const BlockSizes& bs) {
+    // Latency distribution of the statically partitioned and the work-stealing multithreaded GEMM
+    // while background threads compete for a quarter of the cores
+    const int reps = 30;
+    int background = std::max(1, num_threads() / 4);
+    std::atomic<bool> stop{ false };
+    std::vector<std::thread> load;
+    for (int i = 0; i < background; i++) {
+        load.emplace_back([&stop] {
+            volatile double x = 1.0;
+            while (!stop.load(std::memory_order_relaxed)) { x = x * 1.0000001 + 1e-9; }
+        });
+    }
+
+    aligned_vector vc(std::size_t(M) * N);
+    auto measure = [&](auto multiply) {
+        std::vector<double> ms;
+        for (int i = 0; i < reps; i++) { ms.push_back(time_ms(1, [&] { multiply(aT, b, vc.data(), M, K, N, bs); })); }
+        std::sort(ms.begin(), ms.end());
+        return std::make_pair(ms[reps / 2], ms[std::min(reps - 1, reps * 99 / 100)]);
+    };
+    auto [static_p50, static_p99] = measure(multiply_v7_aT_static);
+    auto [stealing_p50, stealing_p99] = measure(multiply_v7_aT);
+    stop = true;
+    for (std::thread& th : load) { th.join(); }
+
+    std::cout << "Tail latency with " << background << " background threads: static p50 " << static_p50
+              << " ms, p99 " << static_p99 << " ms; work-stealing p50 " << stealing_p50 << " ms, p99 "
+              << stealing_p99 << " ms" << std::endl;
+}
+
+void bench_odd_shape(const BlockSizes& bs) {
+    // A shape that is a multiple of no tile size, M x K x N = 1000 x 768 x 3: every variant must agree with
+    // the naive one, and the fast kernels have to cope with fringe tiles on both edges of c
+    int M = 1000, K = 768, N = 3;
+    std::mt19937 e2(1);
+    std::uniform_real_distribution<> dist(0.0, 1.0);
+    std::vector<float> vaT(K * M), vb(K * N);
+    for (float& f : vaT) { f = dist(e2); }
+    for (float& f : vb) { f = dist(e2); }
+    const float* aT = vaT.data();
+    const float* b = vb.data();
+
+    std::vector<float> vref(M * N), vc(M * N);
+    multiply_v0_aT(aT, b, vref.data(), M, K, N);
+    auto check = [&](const char* name) {
+        if (!std::equal(vref.begin(), vref.end(), vc.begin(), vc.end(), epsilon_equal)) {
+            throw std::runtime_error(std::string(name) + " differs from multiply_v0_aT on a 1000 x 768 x 3 product");
+        }
+    };
+    multiply_v1_aT(aT, b, vc.data(), M, K, N); check("multiply_v1_aT");
+    multiply_v2_aT(aT, b, vc.data(), M, K, N, 1.0f, 0.0f); check("multiply_v2_aT");
+    multiply_v3_aT(aT, b, vc.data(), M, K, N, 1.0f, 0.0f); check("multiply_v3_aT");
+    multiply_v4_aT(aT, b, vc.data(), M, K, N); check("multiply_v4_aT");
+    multiply_v5_aT(aT, b, vc.data(), M, K, N, bs); check("multiply_v5_aT");
+    multiply_v6_aT(aT, b, vc.data(), M, K, N, bs); check("multiply_v6_aT");
+    multiply_v7_aT_static(aT, b, vc.data(), M, K, N, bs); check("multiply_v7_aT_static");
+    multiply_v7_aT(aT, b, vc.data(), M, K, N, bs); check("multiply_v7_aT");
+
+    double naive = time_ms(20, [&] { multiply_v0_aT(aT, b, vc.data(), M, K, N); });
+    double fast = time_ms(20, [&] { multiply_v7_aT(aT, b, vc.data(), M, K, N, bs); });
+    std::cout << "Fringe tiles, 1000 x 768 x 3: naive (c = aT * b) " << naive << " ms, version 7 " << fast << " ms"
+              << std::endl;
+}
+
+void bench_sgemm_layouts(const float* a, const float* aT, const float* b, const float* bT, const std::vector<float>& vc,
+                         int M, int K, int N) {
+    // sgemm straight from each of the four storage combinations of the operands, without transposing any of them
+    struct Layout {
+        char transA, transB;
+        const float* A;
+        int lda;
+        const float* B;
+        int ldb;
+    };
+    const Layout layouts[] = { { 'N', 'N', a, K, b, N }, { 'N', 'T', a, K, bT, K },
+                               { 'T', 'N', aT, M, b, N }, { 'T', 'T', aT, M, bT, K } };
+    aligned_vector vc_s(std::size_t(M) * N);
+    std::cout << "sgemm by layout:";
+    for (const Layout& l : layouts) {
+        double ms = time_ms(20, [&] {
+            sgemm(l.transA, l.transB, M, N, K, 1.0f, l.A, l.lda, l.B, l.ldb, 0.0f, vc_s.data(), N);
+        });
+        if (!std::equal(vc.begin(), vc.end(), vc_s.begin(), vc_s.end(), epsilon_equal)) {
+            throw std::runtime_error(std::string("sgemm ") + l.transA + l.transB + " != vc");
+        }
+        std::cout << " " << l.transA << l.transB << " " << ms << " ms";
+    }
+    std::cout << std::endl;
+}
+
+void bench_epilogue(const float* aT, const float* b, int M, int K, int N) {
+    // The inference pattern c = gelu(aT * b + bias) + residual: sgemm followed by a separate pass over c,
+    // the same with the epilogue fused into the tile stores, and with the epilogue as a user functor
+    std::mt19937 gen(7);
+    std::uniform_real_distribution<> dis(-1.0, 1.0);
+    std::vector<float> bias(N), residual(std::size_t(M) * N);
+    for (auto& v : bias) { v = dis(gen); }
+    for (auto& v : residual) { v = dis(gen); }
+    aligned_vector c_sep(std::size_t(M) * N), c_fused(std::size_t(M) * N), c_functor(std::size_t(M) * N);
+
+    Epilogue ep;
+    ep.bias = bias.data();
+    ep.act = Activation::gelu;
+    ep.residual = residual.data();
+    ep.ldr = N;
+    auto bias_gelu_residual = [&](int m, int n, float v) { return gelu(v + bias[n]) + residual[long(m) * N + n]; };
+    Epilogue ep_functor = with_functor(Epilogue(), bias_gelu_residual);
+
+    double separate = time_ms(20, [&] {
+        sgemm('T', 'N', M, N, K, 1.0f, aT, M, b, N, 0.0f, c_sep.data(), N);
+        for (int m = 0; m < M; m++) {
+            for (int n = 0; n < N; n++) {
+                c_sep[long(m) * N + n] = gelu(c_sep[long(m) * N + n] + bias[n]) + residual[long(m) * N + n];
+            }
+        }
+    });
+    double fused = time_ms(20, [&] { sgemm('T', 'N', M, N, K, 1.0f, aT, M, b, N, 0.0f, c_fused.data(), N, ep); });
+    double functor = time_ms(20, [&] { sgemm('T', 'N', M, N, K, 1.0f, aT, M, b, N, 0.0f, c_functor.data(), N, ep_functor); });
+
+    if (!std::equal(c_sep.begin(), c_sep.end(), c_fused.begin(), c_fused.end(), epsilon_equal)) {
+        throw std::runtime_error("fused epilogue != separate pass");
+    }
+    if (!std::equal(c_sep.begin(), c_sep.end(), c_functor.begin(), c_functor.end(), epsilon_equal)) {
+        throw std::runtime_error("functor epilogue != separate pass");
+    }
+    std::cout << "Bias + GELU + residual: separate pass " << separate << " ms, fused " << fused << " ms, functor "
+              << functor << " ms" << std::endl;
+}
+
+void bench_batched() {
+    // Many products of one small shape, M x K x N = 32 x 32 x 32 in the aT * b layout: multiply_v3_aT called in a
+    // loop against sgemm_strided_batched, for batches of 1 to 4096
+    const int M = 32, K = 32, N = 32, max_batch = 4096;
+    std::mt19937 gen(11);
+    std::uniform_real_distribution<> dis(-1.0, 1.0);
+    std::vector<float> aT(std::size_t(max_batch) * K * M), b(std::size_t(max_batch) * K * N);
+    for (auto& v : aT) { v = dis(gen); }
+    for (auto& v : b) { v = dis(gen); }
+    std::vector<float> c_loop(std::size_t(max_batch) * M * N), c_batched(std::size_t(max_batch) * M * N);
+
+    // The first call grows the packing workspaces of the threads, later ones reuse them
+    sgemm_strided_batched('T', 'N', M, N, K, 1.0f, aT.data(), M, long(K) * M, b.data(), N, long(K) * N, 0.0f,
+                          c_batched.data(), N, long(M) * N, max_batch);
+    std::cout << "Batched " << M << " x " << K << " x " << N << " (batch: loop of version 3 / strided batched, ms):";
+    for (int batch = 1; batch <= max_batch; batch *= 4) {
+        // Each batch size is repeated until max_batch products have been timed, so small batches are not a single
+        // call of a few microseconds
+        int reps = max_batch / batch;
+        double loop = time_ms(reps, [&] {
+            for (int i = 0; i < batch; i++) {
+                multiply_v3_aT(aT.data() + long(i) * K * M, b.data() + long(i) * K * N, c_loop.data() + long(i) * M * N, M,
+                               K, N, 1.0f, 0.0f);
+            }
+        });
+        double batched = time_ms(reps, [&] {
+            sgemm_strided_batched('T', 'N', M, N, K, 1.0f, aT.data(), M, long(K) * M, b.data(), N, long(K) * N, 0.0f,
+                                  c_batched.data(), N, long(M) * N, batch);
+        });
+        if (!std::equal(c_loop.begin(), c_loop.begin() + long(batch) * M * N, c_batched.begin(), epsilon_equal)) {
+            throw std::runtime_error("sgemm_strided_batched != multiply_v3_aT");
+        }
+        std::cout << " " << batch << ": " << loop << " / " << batched;
+    }
+    std::cout << std::endl;
+}
+
+void bench_fixed_shapes() {
+    // The registered compile-time shapes against the runtime-shaped multiply_v3_aT and sgemm, per product
+    std::mt19937 gen(13);
+    std::uniform_real_distribution<> dis(-1.0, 1.0);
+    std::cout << "Compile-time shapes (version 3 / sgemm / specialized, us):";
+    for (const FixedShape& shape : fixed_shapes) {
+        int M = shape.M, K = shape.K, N = shape.N;
+        std::vector<float> aT(K * M), b(K * N), c_v3(M * N), c_sgemm(M * N), c_fixed(M * N);
+        for (auto& v : aT) { v = dis(gen); }
+        for (auto& v : b) { v = dis(gen); }
+        const int reps = 2000;
+        auto time = [&](auto&& f) {
+            f();
+            return time_ms(reps, f) * 1e3;
+        };
+        double v3 = time([&] { multiply_v3_aT(aT.data(), b.data(), c_v3.data(), M, K, N, 1.0f, 0.0f); });
+        double generic = time([&] { sgemm('T', 'N', M, N, K, 1.0f, aT.data(), M, b.data(), N, 0.0f, c_sgemm.data(), N); });
+        double fixed = time([&] { multiply_shaped_aT(aT.data(), b.data(), c_fixed.data(), M, K, N); });
+        if (!std::equal(c_v3.begin(), c_v3.end(), c_fixed.begin(), c_fixed.end(), epsilon_equal) ||
+            !std::equal(c_v3.begin(), c_v3.end(), c_sgemm.begin(), c_sgemm.end(), epsilon_equal)) {
+            throw std::runtime_error("multiply_fixed_aT<" + std::to_string(M) + ", " + std::to_string(K) + ", " +
+                                     std::to_string(N) + "> != multiply_v3_aT");
+        }
+        std::cout << " " << M << "x" << K << "x" << N << ": " << v3 << " / " << generic << " / " << fixed;
+    }
+    std::cout << std::endl;
+}
+
+void bench_tiled_variants(const float* aT, const float* b, const std::vector<float>& vc, int M, int K, int N) {
+    // Sweeps the MB x NB x KB instantiations of multiply_tiled_aT on the main shape, then runs the chosen one
+    const std::vector<double>& times = tiled_variant_times(M, K, N);
+    std::cout << "Tiled variants (MB x NB x KB: ms):";
+    for (int i = 0; i < TILED_VARIANTS; i++) {
+        std::cout << " " << tiled_variants[i].mb << "x" << tiled_variants[i].nb << "x" << tiled_variants[i].kb << ": "
+                  << times[i];
+    }
+    std::cout << std::endl;
+
+    std::vector<float> vc_t(std::size_t(M) * N);
+    const TiledVariant& best = best_tiled_variant(M, K, N);
+    double ms = time_ms(20, [&] { multiply_tiled_best_aT(aT, b, vc_t.data(), M, K, N); });
+    if (!std::equal(vc.begin(), vc.end(), vc_t.begin(), vc_t.end(), epsilon_equal)) {
+        throw std::runtime_error("multiply_tiled_best_aT != vc");
+    }
+    std::cout << "Best tiled variant " << best.mb << "x" << best.nb << "x" << best.kb << ": " << ms << " ms" << std::endl;
+}
+
+void bench_hgemm(const float* aT, const float* b, int M, int K, int N) {
+    // aT * b with fp16 storage: sgemm on the fp32 operands against hgemm with fp32 C and with fp16 C. The check is
+    // against sgemm on the operands rounded to fp16, which hgemm with fp32 C matches up to the order of the sums
+    std::vector<half> aT16(std::size_t(K) * M), b16(std::size_t(K) * N);
+    std::vector<float> aT_rounded(aT16.size()), b_rounded(b16.size());
+    for (std::size_t i = 0; i < aT16.size(); i++) {
+        aT16[i] = float_to_half(aT[i]);
+        aT_rounded[i] = half_to_float(aT16[i]);
+    }
+    for (std::size_t i = 0; i < b16.size(); i++) {
+        b16[i] = float_to_half(b[i]);
+        b_rounded[i] = half_to_float(b16[i]);
+    }
+    aligned_vector c_ref(std::size_t(M) * N), c32(std::size_t(M) * N);
+    std::vector<half> c16(std::size_t(M) * N);
+    sgemm('T', 'N', M, N, K, 1.0f, aT_rounded.data(), M, b_rounded.data(), N, 0.0f, c_ref.data(), N);
+
+    double fp32 = time_ms(20, [&] { sgemm('T', 'N', M, N, K, 1.0f, aT, M, b, N, 0.0f, c32.data(), N); });
+    double fp16_c32 = time_ms(20, [&] {
+        hgemm('T', 'N', M, N, K, 1.0f, aT16.data(), M, b16.data(), N, 0.0f, c32.data(), N);
+    });
+    double fp16_c16 = time_ms(20, [&] {
+        hgemm('T', 'N', M, N, K, 1.0f, aT16.data(), M, b16.data(), N, 0.0f, c16.data(), N);
+    });
+
+    if (!std::equal(c_ref.begin(), c_ref.end(), c32.begin(), c32.end(), epsilon_equal)) {
+        throw std::runtime_error("hgemm != sgemm of the rounded operands");
+    }
+    // fp16 C keeps 11 significant bits
+    for (std::size_t i = 0; i < c16.size(); i++) {
+        if (std::abs(half_to_float(c16[i]) - c_ref[i]) > 1e-3f * std::max(1.0f, std::abs(c_ref[i]))) {
+            throw std::runtime_error("hgemm with fp16 C != sgemm of the rounded operands");
+        }
+    }
+    std::cout << "FP16 storage (" << (has_f16c() ? "F16C" : "portable") << " conversions): sgemm " << fp32
+              << " ms, hgemm fp32 C " << fp16_c32 << " ms, hgemm fp16 C " << fp16_c16 << " ms" << std::endl;
+}
+
+void bench_bf16(const float* aT, const float* b, int M, int K, int N) {
+    // aT * b with bf16 storage: sgemm on the fp32 operands against the vdpbf16ps and the emulated bf16gemm, both
+    // checked against sgemm on the operands rounded to bf16
+    std::vector<bf16> aT16(std::size_t(K) * M), b16(std::size_t(K) * N);
+    std::vector<float> aT_rounded(aT16.size()), b_rounded(b16.size());
+    for (std::size_t i = 0; i < aT16.size(); i++) {
+        aT16[i] = float_to_bf16(aT[i]);
+        aT_rounded[i] = bf16_to_float(aT16[i]);
+    }
+    for (std::size_t i = 0; i < b16.size(); i++) {
+        b16[i] = float_to_bf16(b[i]);
+        b_rounded[i] = bf16_to_float(b16[i]);
+    }
+    aligned_vector c_ref(std::size_t(M) * N), c32(std::size_t(M) * N), c_emulated(std::size_t(M) * N),
+        c_native(std::size_t(M) * N);
+    sgemm('T', 'N', M, N, K, 1.0f, aT_rounded.data(), M, b_rounded.data(), N, 0.0f, c_ref.data(), N);
+
+    double fp32 = time_ms(20, [&] { sgemm('T', 'N', M, N, K, 1.0f, aT, M, b, N, 0.0f, c32.data(), N); });
+    double emulated = time_ms(20, [&] {
+        bf16gemm_emulated('T', 'N', M, N, K, 1.0f, aT16.data(), M, b16.data(), N, 0.0f, c_emulated.data(), N);
+    });
+    if (!std::equal(c_ref.begin(), c_ref.end(), c_emulated.begin(), c_emulated.end(), epsilon_equal)) {
+        throw std::runtime_error("emulated bf16gemm != sgemm of the rounded operands");
+    }
+    std::cout << "BF16 storage: sgemm " << fp32 << " ms, emulated bf16gemm " << emulated << " ms";
+    if (has_avx512_bf16()) {
+        double native = time_ms(20, [&] {
+            bf16gemm_avx512('T', 'N', M, N, K, 1.0f, aT16.data(), M, b16.data(), N, 0.0f, c_native.data(), N,
+                            tuned_blocks(M, K, N));
+        });
+        if (!std::equal(c_ref.begin(), c_ref.end(), c_native.begin(), c_native.end(), epsilon_equal)) {
+            throw std::runtime_error("vdpbf16ps bf16gemm != sgemm of the rounded operands");
+        }
+        std::cout << ", vdpbf16ps bf16gemm " << native << " ms";
+    }
+    std::cout << std::endl;
+}
+
+void bench_qgemm(const float* aT, const float* b, int M, int K, int N) {
+    // aT * b quantized: u8 aT with a scale and zero point per row of a, s8 b with a scale per column, once
+    // symmetric and once with a zero point over the range of b. The fp32 C of qgemm is checked against sgemm on
+    // the dequantized operands for both and on every int8 microkernel this machine runs, the int8 C on the one
+    // qgemm picks; that one is timed against sgemm on the fp32 operands
+    std::vector<uint8_t> aT8(std::size_t(K) * M);
+    std::vector<float> a_scale(M), aT_dequantized(aT8.size());
+    const int a_zero = 128;
     for (int m = 0; m < M; m++) {
+        float max_abs = 1e-30f;
+        for (int k = 0; k < K; k++) { max_abs = std::max(max_abs, std::abs(aT[long(k) * M + m])); }
+        a_scale[m] = max_abs / 127.0f;
+        for (int k = 0; k < K; k++) {
+            aT8[long(k) * M + m] = uint8_t(std::nearbyint(aT[long(k) * M + m] / a_scale[m]) + a_zero);
+            aT_dequantized[long(k) * M + m] = a_scale[m] * float(aT8[long(k) * M + m] - a_zero);
+        }
+    }
+
+    // b quantized with one zero point for all columns: 0, or the one that maps the range of b onto [-128, 127]
+    auto quantize_b = [&](bool asymmetric, std::vector<int8_t>& b8, std::vector<float>& b_scale,
+                          std::vector<float>& b_dequantized) {
+        float lo = 0.0f, hi = 0.0f;
+        for (long i = 0; i < long(K) * N; i++) {
+            lo = std::min(lo, b[i]);
+            hi = std::max(hi, b[i]);
+        }
+        int zero = 0;
+        if (asymmetric && hi > lo) {
+            zero = int(std::clamp(std::nearbyint(-128.0f - 255.0f * lo / (hi - lo)), -127.0f, 126.0f));
+        }
+        b8.resize(std::size_t(K) * N);
+        b_scale.resize(N);
+        b_dequantized.resize(b8.size());
         for (int n = 0; n < N; n++) {
-            c[m * N + n] = 0.0;
+            float col_lo = 0.0f, col_hi = 0.0f;
             for (int k = 0; k < K; k++) {
-                // c[m, n] += aT[k, m] * b[k, n]
-                // c[m, n] = c[m * N + n]
-                // aT[k, m] = aT[k * M + m]
-                // b[k, n] = b[k * N + n]
-                c[m * N + n] += aT[k * M + m] * b[k * N + n];
+                col_lo = std::min(col_lo, b[long(k) * N + n]);
+                col_hi = std::max(col_hi, b[long(k) * N + n]);
+            }
+            b_scale[n] = std::max({ 1e-30f, col_hi / float(127 - zero), col_lo / float(-128 - zero) });
+            for (int k = 0; k < K; k++) {
+                float v = std::clamp(std::nearbyint(b[long(k) * N + n] / b_scale[n]) + zero, -128.0f, 127.0f);
+                b8[long(k) * N + n] = int8_t(v);
+                b_dequantized[long(k) * N + n] = b_scale[n] * float(b8[long(k) * N + n] - zero);
             }
         }
+        return zero;
     };
+
+    aligned_vector c_ref(std::size_t(M) * N), c32(std::size_t(M) * N), c_dequantized(std::size_t(M) * N);
+    std::vector<int8_t> b8, c8(std::size_t(M) * N);
+    std::vector<float> b_scale, b_dequantized;
+    Quantization q;
+    q.a_zero = a_zero;
+    q.a_scale = a_scale.data();
+    q.c_scale = 0.25f;
+    const std::vector<Int8KernelInfo> kernels = int8_kernels();
+    for (bool asymmetric : { false, true }) {
+        q.b_zero = quantize_b(asymmetric, b8, b_scale, b_dequantized);
+        q.b_scale = b_scale.data();
+        sgemm('T', 'N', M, N, K, 1.0f, aT_dequantized.data(), M, b_dequantized.data(), N, 0.0f, c_ref.data(), N);
+        for (const Int8KernelInfo& ki : kernels) {
+            qgemm_on_pool('T', 'N', M, N, K, aT8.data(), M, b8.data(), N, q, c_dequantized.data(), N, Epilogue(), ki,
+                          int8_block_sizes(ki));
+            if (!std::equal(c_ref.begin(), c_ref.end(), c_dequantized.begin(), c_dequantized.end(), epsilon_equal)) {
+                throw std::runtime_error(std::string("qgemm (") + ki.name + ", b_zero = " + std::to_string(q.b_zero) +
+                                         ") != sgemm of the dequantized operands");
+            }
+        }
+        qgemm('T', 'N', M, N, K, aT8.data(), M, b8.data(), N, q, c8.data(), N);
+        for (std::size_t i = 0; i < c8.size(); i++) {
+            if (std::abs(std::min(127.0f, std::max(-128.0f, std::nearbyint(c_ref[i] / q.c_scale))) - c8[i]) > 1.0f) {
+                throw std::runtime_error("requantized qgemm (b_zero = " + std::to_string(q.b_zero) +
+                                         ") != sgemm of the dequantized operands");
+            }
+        }
+    }
+
+    double fp32 = time_ms(20, [&] { sgemm('T', 'N', M, N, K, 1.0f, aT, M, b, N, 0.0f, c32.data(), N); });
+    double dequantize = time_ms(20, [&] {
+        qgemm('T', 'N', M, N, K, aT8.data(), M, b8.data(), N, q, c_dequantized.data(), N);
+    });
+    double requantize = time_ms(20, [&] { qgemm('T', 'N', M, N, K, aT8.data(), M, b8.data(), N, q, c8.data(), N); });
+    std::cout << "INT8 (" << int8_kernel_info().name << ", checked:";
+    for (const Int8KernelInfo& ki : kernels) { std::cout << " " << ki.name; }
+    std::cout << "; b_zero 0 and " << q.b_zero << "): sgemm " << fp32 << " ms, qgemm to fp32 " << dequantize
+              << " ms, qgemm to int8 " << requantize << " ms" << std::endl;
 }
 
-void multiply_v1_aT(const float* __restrict__ aT, const float* __restrict__ b, float* __restrict__ c, int M, int K, int N) {
-    // c = aT * b, the second variant
-    assert(N % 16 == 0);
-    for (int m = 0; m < M; m++) {
-        for (int n1 = 0; n1 < N; n1 += 16) {
-            for (int n2 = 0; n2 < 16; n2++) {
-                c[m * N + n1 + n2] = 0.0;
-                for (int k = 0; k < K; k++) {
-                    c[m * N + n1 + n2] += aT[k * M + m] * b[k * N + n1 + n2];
+void bench_dgemm(const float* aT, const float* b, const std::vector<float>& vc, int M, int K, int N) {
+    // aT * b in double precision: dgemm against sgemm on the same values, both checked against vc
+    std::vector<double> aT64(aT, aT + std::size_t(K) * M), b64(b, b + std::size_t(K) * N);
+    aligned_vector c32(std::size_t(M) * N);
+    std::vector<double, AlignedAllocator<double>> c64(std::size_t(M) * N);
+
+    double fp32 = time_ms(20, [&] { sgemm('T', 'N', M, N, K, 1.0f, aT, M, b, N, 0.0f, c32.data(), N); });
+    double fp64 = time_ms(20, [&] { dgemm('T', 'N', M, N, K, 1.0, aT64.data(), M, b64.data(), N, 0.0, c64.data(), N); });
+
+    if (!std::equal(vc.begin(), vc.end(), c64.begin(), c64.end(), epsilon_equal)) {
+        throw std::runtime_error("dgemm != vc");
+    }
+    const KernelInfoOf<double>& ki = kernel_info<double>();
+    std::cout << "Double precision (" << ki.name << " " << ki.mr << "x" << ki.nr << " tile): sgemm " << fp32 << " ms, "
+              << 2.0 * M * N * K / fp32 * 1e-6 << " GFLOP/s, dgemm " << fp64 << " ms, " << 2.0 * M * N * K / fp64 * 1e-6
+              << " GFLOP/s" << std::endl;
+}
+
+void bench_strassen(int n) {
+    // sgemm_strassen against sgemm on n x n x n, at the configured cutoff and with one and two levels forced
+    std::vector<float> a(std::size_t(n) * n), b(std::size_t(n) * n);
+    aligned_vector c(std::size_t(n) * n);
+    std::mt19937 gen(20);
+    std::uniform_real_distribution<> dis(-1.0, 1.0);
+    for (auto& v : a) { v = dis(gen); }
+    for (auto& v : b) { v = dis(gen); }
+
+    double classical = time_ms(5, [&] { sgemm('N', 'N', n, n, n, 1.0f, a.data(), n, b.data(), n, 0.0f, c.data(), n); });
+    std::cout << "Strassen " << n << "^3: sgemm " << classical << " ms" << std::endl;
+    std::vector<int> cutoffs = { strassen_cutoff(), n / 2, n / 4 };
+    std::sort(cutoffs.begin(), cutoffs.end(), std::greater<int>());
+    cutoffs.erase(std::unique(cutoffs.begin(), cutoffs.end()), cutoffs.end());
+    for (int cutoff : cutoffs) {
+        double strassen = time_ms(5, [&] { sgemm_strassen(n, n, n, a.data(), n, b.data(), n, c.data(), n, cutoff); });
+        StrassenReport report = sgemm_strassen(n, n, n, a.data(), n, b.data(), n, c.data(), n, cutoff, true);
+        std::cout << "  cutoff " << cutoff << ": " << report.levels << " levels, " << strassen << " ms, max error "
+                  << report.max_abs_error << " (relative " << report.max_rel_error << ")" << std::endl;
+    }
+}
+
+void bench_spmm(int M, int K, int N) {
+    // The density crossover of the sparse kernels: sgemm against spmm_csr on aT * b with a of a given fraction of
+    // nonzeros, scattered, and against spmm_csr and spmm_bcsr when the nonzeros come in 4 x 4 blocks
+    std::mt19937 gen(21);
+    std::uniform_real_distribution<> dis(-1.0, 1.0), coin(0.0, 1.0);
+    std::vector<float> aT(std::size_t(K) * M), b(std::size_t(K) * N);
+    for (auto& v : b) { v = dis(gen); }
+    aligned_vector c_dense(std::size_t(M) * N), c_sparse(std::size_t(M) * N);
+
+    auto check = [&](const char* name) {
+        if (!std::equal(c_dense.begin(), c_dense.end(), c_sparse.begin(), epsilon_equal)) {
+            throw std::runtime_error(std::string(name) + " != sgemm");
+        }
+    };
+
+    std::cout << "Sparse " << M << " x " << K << " x " << N << " (density: sgemm / csr, blocked: sgemm / csr / bcsr, ms):";
+    double csr_crossover = 0.0, bcsr_crossover = 0.0;
+    for (double density : { 0.5, 0.3, 0.2, 0.1, 0.05, 0.02, 0.01 }) {
+        for (auto& v : aT) { v = coin(gen) < density ? dis(gen) : 0.0f; }
+        double dense = time_ms(5, [&] {
+            sgemm('T', 'N', M, N, K, 1.0f, aT.data(), M, b.data(), N, 0.0f, c_dense.data(), N);
+        });
+        CsrMatrix csr = csr_from_aT(aT.data(), M, K);
+        double sparse = time_ms(5, [&] { spmm_csr(csr, b.data(), c_sparse.data(), N); });
+        check("spmm_csr");
+
+        // The same density in whole 4 x 4 blocks
+        for (int k0 = 0; k0 < K; k0 += BcsrMatrix::COLS) {
+            for (int m0 = 0; m0 < M; m0 += BcsrMatrix::ROWS) {
+                bool keep = coin(gen) < density;
+                for (int k = k0; k < std::min(K, k0 + BcsrMatrix::COLS); k++) {
+                    for (int m = m0; m < std::min(M, m0 + BcsrMatrix::ROWS); m++) {
+                        aT[long(k) * M + m] = keep ? dis(gen) : 0.0f;
+                    }
                 }
             }
         }
+        double blocked_dense = time_ms(5, [&] {
+            sgemm('T', 'N', M, N, K, 1.0f, aT.data(), M, b.data(), N, 0.0f, c_dense.data(), N);
+        });
+        CsrMatrix blocked_csr = csr_from_aT(aT.data(), M, K);
+        double blocked_sparse = time_ms(5, [&] { spmm_csr(blocked_csr, b.data(), c_sparse.data(), N); });
+        check("spmm_csr");
+        BcsrMatrix bcsr = bcsr_from_aT(aT.data(), M, K);
+        double blocked_bcsr = time_ms(5, [&] { spmm_bcsr(bcsr, b.data(), c_sparse.data(), N); });
+        check("spmm_bcsr");
+
+        if (csr_crossover == 0.0 && sparse < dense) { csr_crossover = density; }
+        if (bcsr_crossover == 0.0 && blocked_bcsr < blocked_dense) { bcsr_crossover = density; }
+        std::cout << " " << density << ": " << dense << " / " << sparse << ", " << blocked_dense << " / " << blocked_sparse
+                  << " / " << blocked_bcsr;
+    }
+    std::cout << std::endl;
+    auto crossover = [](double density) { return density > 0.0 ? std::to_string(density) : std::string("below 0.01"); };
+    std::cout << "Sparse beats sgemm from density " << crossover(csr_crossover) << " (csr), " << crossover(bcsr_crossover)
+              << " (bcsr, 4 x 4 blocks)" << std::endl;
+}
+
+void bench_2_4(const float* aT, const float* b, int M, int K, int N) {
+    // aT * b with aT pruned to 2:4 sparsity, each ratio between kernels on the same threads: on one thread
+    // spmm_2_4's tiles against the packed five loops of gemm_serial and the dense tiled kernel, then spmm_2_4
+    // against sgemm on the whole pool
+    std::vector<float> pruned(aT, aT + std::size_t(K) * M);
+    prune_2_4_aT(pruned.data(), M, K);
+    Sparse24Matrix a = sparse24_from_aT(pruned.data(), M, K);
+    aligned_vector c_dense(std::size_t(M) * N), c_sparse(std::size_t(M) * N);
+    auto check = [&](const char* name) {
+        if (!std::equal(c_dense.begin(), c_dense.end(), c_sparse.begin(), epsilon_equal)) {
+            throw std::runtime_error(std::string(name) + " != dense");
+        }
     };
+
+    GemmWorkspace ws;
+    const BlockSizes& bs = tuned_blocks(M, K, N);
+    best_tiled_variant(M, K, N);  // The tiled variants are measured on first use, not in the timing
+    double tiled = time_ms(5, [&] { multiply_tiled_best_aT(pruned.data(), b, c_dense.data(), M, K, N); });
+    double packed_serial = time_ms(5, [&] {
+        gemm_serial('T', 'N', M, N, K, 1.0f, pruned.data(), M, b, N, 0.0f, c_dense.data(), N, bs, ws);
+    });
+    double sparse_serial = time_ms(5, [&] { spmm_2_4_rows(a, 0, M, b, c_sparse.data(), N, 1.0f, 0.0f); });
+    check("spmm_2_4_rows");
+    double dense = time_ms(5, [&] { sgemm('T', 'N', M, N, K, 1.0f, pruned.data(), M, b, N, 0.0f, c_dense.data(), N); });
+    double sparse = time_ms(5, [&] { spmm_2_4(a, b, c_sparse.data(), N); });
+    check("spmm_2_4");
+    std::cout << "2:4 sparse (" << a.values.size() * sizeof(float) + a.indices.size() << " of " << long(M) * K * sizeof(float)
+              << " bytes): one thread packed " << packed_serial << " ms, tiled " << tiled << " ms, 2:4 " << sparse_serial
+              << " ms (" << packed_serial / sparse_serial << "x packed, " << tiled / sparse_serial << "x tiled); "
+              << WorkStealingPool::instance().size() << " threads sgemm " << dense << " ms, 2:4 " << sparse << " ms ("
+              << dense / sparse << "x)" << std::endl;
 }
 
-void multiply_v2_aT(const float* __restrict__ aT, const float* __restrict__ b, float* __restrict__ c, int M, int K, int N) {
-    // c = aT * b, the accelerated variant
-    assert(N % 16 == 0);
-    for (int i = 0; i < M * N; i++) { c[i] = 0.0; }
+void bench_sddmm(int M, int K, int N) {
+    // a * bT sampled at a random mask of M x N of a given density: sddmm against sgemm computing all of a * bT
+    std::mt19937 gen(23);
+    std::uniform_real_distribution<> dis(-1.0, 1.0), coin(0.0, 1.0);
+    std::vector<float> a(std::size_t(M) * K), bT(std::size_t(N) * K);
+    for (auto& v : a) { v = dis(gen); }
+    for (auto& v : bT) { v = dis(gen); }
+    aligned_vector c(std::size_t(M) * N);
 
-    for (int m = 0; m < M; m++) {
-        for (int n1 = 0; n1 < N; n1 += 16) {
-                for (int k = 0; k < K; k++) {
-                    for (int n2 = 0; n2 < 16; n2++) {
-                        c[m * N + n1 + n2] += aT[k * M + m] * b[k * N + n1 + n2];
+    double dense = time_ms(5, [&] { sgemm('N', 'T', M, N, K, 1.0f, a.data(), K, bT.data(), K, 0.0f, c.data(), N); });
+    std::cout << "SDDMM " << M << " x " << K << " x " << N << " (density: ms, sgemm " << dense << " ms):";
+    for (double density : { 0.1, 0.01, 0.001 }) {
+        CsrMatrix mask;
+        mask.rows = M;
+        mask.cols = N;
+        mask.row_ptr.push_back(0);
+        for (int m = 0; m < M; m++) {
+            for (int n = 0; n < N; n++) {
+                if (coin(gen) < density) {
+                    mask.col_idx.push_back(n);
+                    mask.values.push_back(1.0f);
                 }
             }
+            mask.row_ptr.push_back(int(mask.col_idx.size()));
         }
-    };
+        std::vector<float> values(mask.values.size());
+        double sparse = time_ms(5, [&] { sddmm(mask, a.data(), bT.data(), K, values.data()); });
+        for (int m = 0; m < M; m++) {
+            for (int p = mask.row_ptr[m]; p < mask.row_ptr[m + 1]; p++) {
+                if (!epsilon_equal(values[p], c[long(m) * N + mask.col_idx[p]])) {
+                    throw std::runtime_error("sddmm != sgemm");
+                }
+            }
+        }
+        std::cout << " " << density << ": " << sparse;
+    }
+    std::cout << std::endl;
 }
 
-void multiply_v3_aT(const float* __restrict__ aT, const float* __restrict__ b, float* __restrict__ c, int M, int K, int N) {
-    // c = aT * b, the double-loop acceleration
-    assert(N % 16 == 0);
-    assert(M % 16 == 0);
-    for (int i = 0; i < M * N; i++) { c[i] = 0.0; }
+void bench_split_k(int M, int K, int N) {
+    // A small C over a deep K: sgemm against sgemm_split_k, whose C must come out bitwise the same on the shared
+    // pool, on one worker and on three
+    // Positive entries, so that c grows with K and the relative tolerance of epsilon_equal stays meaningful
+    std::mt19937 gen(25);
+    std::uniform_real_distribution<> dis(0.0, 1.0);
+    std::vector<float> a(std::size_t(M) * K), b(std::size_t(K) * N);
+    for (auto& v : a) { v = dis(gen); }
+    for (auto& v : b) { v = dis(gen); }
+    aligned_vector c(std::size_t(M) * N), c_split(std::size_t(M) * N), c_other(std::size_t(M) * N);
 
-    for (int m1 = 0; m1 < M; m1 += 16) {
-        for (int n1 = 0; n1 < N; n1 += 16) {
-            for (int k = 0; k < K; k++) {
-                for (int m2 = 0; m2 < 16; m2++) {
-                    for (int n2 = 0; n2 < 16; n2++) {
-                        c[(m1 + m2) * N + n1 + n2] += aT[k * M + m1 + m2] * b[k * N + n1 + n2];
-                    }
-                }
+    double dense = time_ms(5, [&] { sgemm('N', 'N', M, N, K, 1.0f, a.data(), K, b.data(), N, 0.0f, c.data(), N); });
+    double split = time_ms(5, [&] {
+        sgemm_split_k('N', 'N', M, N, K, 1.0f, a.data(), K, b.data(), N, 0.0f, c_split.data(), N);
+    });
+    if (!std::equal(c.begin(), c.end(), c_split.begin(), epsilon_equal)) {
+        throw std::runtime_error("sgemm_split_k != sgemm");
+    }
+    for (int workers : { 1, 3 }) {
+        WorkStealingPool pool(workers);
+        sgemm_split_k('N', 'N', M, N, K, 1.0f, a.data(), K, b.data(), N, 0.0f, c_other.data(), N, pool);
+        if (std::memcmp(c_split.data(), c_other.data(), c_split.size() * sizeof(float)) != 0) {
+            throw std::runtime_error("sgemm_split_k on " + std::to_string(workers) + " workers differs from the pool");
+        }
+    }
+    std::cout << "Split-K " << M << " x " << K << " x " << N << " (" << split_k_slices(M, N, K) << " slices, bitwise equal on 1, 3 and "
+              << WorkStealingPool::instance().size() << " workers): sgemm " << dense << " ms, split-K " << split << " ms ("
+              << dense / split << "x)" << std::endl;
+}
+
+MULTIVERSION
+float sum_floats(const float* __restrict__ x, long n) {
+    // The sum of x[0 .. n): a read-only stream like the reads of A by the GEMV kernels, built for the same ISAs.
+    // As gemv_rows reads GEMV_ROWS rows at once, x is read as that many concurrent streams, its quarters, each
+    // in GEMV_LANES partial sums. These are vfloat4s, one xmm register each in every clone, and the loops over
+    // them are unrolled so that they stay registers
+    constexpr int U = GEMV_ROWS, V = GEMV_LANES, W = sizeof(vfloat4) / sizeof(float);
+    const long part = n / (U * V) * V;
+    const float* __restrict__ streams[U];
+    for (int u = 0; u < U; u++) { streams[u] = x + u * part; }
+    vfloat4 acc[U][V / W] = {};
+    for (long i = 0; i < part; i += V) {
+#pragma GCC unroll 4
+        for (int u = 0; u < U; u++) {
+#pragma GCC unroll 4
+            for (int w = 0; w < V / W; w++) {
+                vfloat4 v;
+                std::memcpy(&v, streams[u] + i + w * W, sizeof(vfloat4));
+                acc[u][w] += v;
             }
         }
-    };
+    }
+    float sum = 0.0f;
+    for (int u = 0; u < U; u++) {
+        for (int w = 0; w < V / W; w++) {
+            for (int k = 0; k < W; k++) { sum += acc[u][w][k]; }
+        }
+    }
+    for (long i = U * part; i < n; i++) { sum += x[i]; }
+    return sum;
 }
 
-bool epsilon_equal(float a, float b) {
-    // Equality with the given accuracy
-    return std::abs(a - b) < 1e-4;
+double stream_read_gbps(long n) {
+    // The peak read bandwidth of this machine's memory: the best of 5 runs of sum_floats over n floats, split
+    // over the pool, counting the n * 4 bytes read. Like a GEMV it only reads, so there is no write-allocate
+    // traffic that a STREAM triad would leave uncounted
+    aligned_vector x(n);
+    WorkStealingPool& pool = WorkStealingPool::instance();
+    int tasks = TILES_PER_WORKER * pool.size();
+    // The array is first touched by the tasks that will stream it
+    pool.run(tasks, [&](int t, int) { std::fill(x.begin() + n * t / tasks, x.begin() + n * (t + 1) / tasks, 1.0f); });
+    std::vector<float> sums(tasks);
+    double best = 0.0;
+    for (int rep = 0; rep < 5; rep++) {
+        double ms = time_ms(1, [&] {
+            pool.run(tasks, [&](int t, int) {
+                long i0 = n * t / tasks, i1 = n * (t + 1) / tasks;
+                sums[t] = sum_floats(x.data() + i0, i1 - i0);
+            });
+        });
+        best = std::max(best, n * sizeof(float) / ms * 1e-6);
+    }
+    return best;
 }
 
-void print_mat(const float* c, int M, int N) {
-    // A function for pretty printing of a matrix
-    for (int i = 0; i < M; i++) {
-        for (int j = 0; j < N; j++) {
-            std::cout << c[i * N + j] << " ";
+void bench_gemv(int M, int K) {
+    // The GEMV engine on A ~ M x K, larger than the caches, with N = 1 .. GEMV_MAX_N, for aT and row-major A:
+    // the bandwidth it reaches against the peak read bandwidth, and the time of the packed engine on the same
+    // product
+    std::mt19937 gen(24);
+    std::uniform_real_distribution<> dis(-1.0, 1.0);
+    std::vector<float> a(std::size_t(M) * K), aT(std::size_t(K) * M), x(std::size_t(K) * GEMV_MAX_N);
+    for (auto& v : a) { v = dis(gen); }
+    for (auto& v : x) { v = dis(gen); }
+    transpose_matr(a.data(), aT.data(), M, K);
+    aligned_vector y(std::size_t(M) * GEMV_MAX_N), y_packed(std::size_t(M) * GEMV_MAX_N);
+
+    double peak = stream_read_gbps(32L * 1024 * 1024);
+    std::cout << "GEMV " << M << " x " << K << " (read bandwidth " << peak << " GB/s):" << std::endl;
+    for (int N = 1; N <= GEMV_MAX_N; N++) {
+        double bytes = (double(M) * K + double(N) * (K + M)) * sizeof(float);
+        gemm_on_pool('T', 'N', M, N, K, 1.0f, aT.data(), M, x.data(), N, 0.0f, y_packed.data(), N, Epilogue(),
+                     tuned_blocks(M, K, N));
+        double packed = time_ms(5, [&] {
+            gemm_on_pool('T', 'N', M, N, K, 1.0f, aT.data(), M, x.data(), N, 0.0f, y_packed.data(), N, Epilogue(),
+                         tuned_blocks(M, K, N));
+        });
+        std::cout << "  N = " << N << ": packed sgemm " << packed << " ms";
+        for (char transA : { 'T', 'N' }) {
+            const float* A = transA == 'T' ? aT.data() : a.data();
+            int lda = transA == 'T' ? M : K;
+            double ms = time_ms(5, [&] { sgemm(transA, 'N', M, N, K, 1.0f, A, lda, x.data(), N, 0.0f, y.data(), N); });
+            if (!std::equal(y.begin(), y.begin() + long(M) * N, y_packed.begin(), epsilon_equal)) {
+                throw std::runtime_error(std::string("gemv ") + transA + " != gemm_on_pool");
+            }
+            double gbps = bytes / (ms * 1e6);
+            std::cout << ", " << (transA == 'T' ? "aT " : "row-major ") << ms << " ms " << gbps << " GB/s ("
+                      << 100.0 * gbps / peak << "% of peak)";
         }
         std::cout << std::endl;
     }
-    std::cout << std::endl;
 }
 
-void transpose_matr(const float* __restrict__ p, float* __restrict__ pT, int M, int K) {
-    // A function that transposes a matrix
-    for (int i = 0; i < M; i++) {
-        for (int j = 0; j < K; j++) {
-            pT[j * M + i] = p[i * K + j];
+void autotune(const std::vector<std::tuple<int, int, int>>& shapes) {
+    // The --autotune mode: for every shape M x K x N, sweeps the cache blocking of sgemm over multiples of the
+    // microkernel's tile and the tiled variants, then measures the cutoff of sgemm_strassen, and stores the results
+    // in the tuning file under this CPU model and microkernel. Entries of other CPUs and shapes in the file are kept
+    const KernelInfo& ki = kernel_info();
+    const std::string cpu = cpu_model(), path = tuning_path();
+    TuningFile entries = read_tuning_file(path);
+    std::cout << "Autotuning on " << cpu << " with the " << ki.name << " microkernel" << std::endl;
+
+    std::mt19937 gen(19);
+    std::uniform_real_distribution<> dis(-1.0, 1.0);
+    for (const auto& [M, K, N] : shapes) {
+        std::vector<float> aT(std::size_t(K) * M), b(std::size_t(K) * N);
+        aligned_vector c(std::size_t(M) * N);
+        for (auto& v : aT) { v = dis(gen); }
+        for (auto& v : b) { v = dis(gen); }
+
+        Tuning best{ default_blocks(), 16, 16, 0 };
+        double best_time = 1e300;
+        for (int kc : { 64, 128, 256, 384, 512 }) {
+            for (int mc_tiles : { 8, 16, 32, 64 }) {
+                for (int nc_tiles : { 8, 32, 128 }) {
+                    BlockSizes bs{ mc_tiles * ki.mr, kc, nc_tiles * ki.nr };
+                    // The best of three runs, after one that warms up the caches
+                    double time = 1e300;
+                    for (int i = 0; i < 4; i++) {
+                        double ms = time_ms(1, [&] {
+                            sgemm('T', 'N', M, N, K, 1.0f, aT.data(), M, b.data(), N, 0.0f, c.data(), N, Epilogue(), bs);
+                        });
+                        if (i > 0) { time = std::min(time, ms); }
+                    }
+                    if (time < best_time) {
+                        best_time = time;
+                        best.blocks = bs;
+                    }
+                }
+            }
+        }
+
+        const std::vector<double>& times = tiled_variant_times(M, K, N);
+        const TiledVariant& tiled = tiled_variants[std::min_element(times.begin(), times.end()) - times.begin()];
+        best.mb = tiled.mb;
+        best.nb = tiled.nb;
+        best.kb = tiled.kb;
+        entries.shapes[{ cpu, ki.name, M, K, N }] = best;
+        std::cout << M << " x " << K << " x " << N << ": mc = " << best.blocks.mc << ", kc = " << best.blocks.kc
+                  << ", nc = " << best.blocks.nc << " (" << best_time << " ms), tile " << tiled.mb << "x" << tiled.nb << "x"
+                  << tiled.kb << " (" << *std::min_element(times.begin(), times.end()) << " ms)" << std::endl;
+    }
+
+    // The Strassen crossover: the smallest square size at which one level of sgemm_strassen beats sgemm makes
+    // half of it the cutoff; if none does, Strassen stays off up to the largest size tried
+    int cutoff = 0;
+    for (int n : { 512, 1024, 2048, 4096 }) {
+        std::vector<float> a(std::size_t(n) * n), b(std::size_t(n) * n);
+        aligned_vector c(std::size_t(n) * n);
+        for (auto& v : a) { v = dis(gen); }
+        for (auto& v : b) { v = dis(gen); }
+        auto best_of_three = [](auto&& f) {
+            double time = 1e300;
+            for (int i = 0; i < 4; i++) {
+                double ms = time_ms(1, f);
+                if (i > 0) { time = std::min(time, ms); }
+            }
+            return time;
+        };
+        double classical = best_of_three([&] { sgemm('N', 'N', n, n, n, 1.0f, a.data(), n, b.data(), n, 0.0f, c.data(), n); });
+        double strassen = best_of_three([&] { sgemm_strassen(n, n, n, a.data(), n, b.data(), n, c.data(), n, n / 2); });
+        std::cout << "Strassen " << n << "^3: sgemm " << classical << " ms, one level " << strassen << " ms" << std::endl;
+        cutoff = n;
+        if (strassen < classical) {
+            cutoff = n / 2;
+            break;
         }
     }
+    entries.strassen_cutoffs[{ cpu, ki.name }] = cutoff;
+    std::cout << "Strassen cutoff: " << cutoff << std::endl;
+    write_tuning_file(path, entries);
+    std::cout << "Wrote " << path << std::endl;
 }
 
 void tiny_test() {
@@ -154,14 +4401,36 @@ void tiny_test() {
 
     // Output matrix c1_aT = aT * b ~ M x N (obtained using the accelerated variant)
     std::vector<float> vc1_aT(M * N);
-    multiply_v2_aT(aT, b, vc1_aT.data(), M, K, N);
+    multiply_v2_aT(aT, b, vc1_aT.data(), M, K, N, 1.0f, 0.0f);
     print_mat(vc1_aT.data(), M, N);
+
+    // Output matrix c2_aT = aT * b ~ M x N (obtained using the kernel specialized for 3 x 2 x 16)
+    std::vector<float> vc2_aT(M * N);
+    multiply_shaped_aT(aT, b, vc2_aT.data(), M, K, N);
+    print_mat(vc2_aT.data(), M, N);
 }
 
-int main() {
-#ifdef __AVX512F__
-    std::cout << "AVX-512 is defined" << std::endl;
-#endif
+int main(int argc, char** argv) {
+    // "tvm_learn --autotune [MxKxN ...]" tunes the given shapes (by default the ones benchmarked below) and exits
+    if (argc > 1 && std::strcmp(argv[1], "--autotune") == 0) {
+        std::vector<std::tuple<int, int, int>> shapes;
+        for (int i = 2; i < argc; i++) {
+            int M, K, N;
+            if (std::sscanf(argv[i], "%dx%dx%d", &M, &K, &N) != 3 || M <= 0 || K <= 0 || N <= 0) {
+                std::cerr << "Expected a shape MxKxN, got " << argv[i] << std::endl;
+                return 1;
+            }
+            shapes.emplace_back(M, K, N);
+        }
+        if (shapes.empty()) { shapes = { { 4096, 1024, 128 }, { 1000, 768, 3 }, { 64, 64, 64 } }; }
+        autotune(shapes);
+        return 0;
+    }
+
+    const KernelInfo& ki = kernel_info();
+    std::cout << "Microkernel: " << ki.name << " (" << ki.mr << " x " << ki.nr << ")" << std::endl;
+    const BlockSizes bs = default_block_sizes(ki);
+    std::cout << "Cache blocking: mc = " << bs.mc << ", kc = " << bs.kc << ", nc = " << bs.nc << std::endl;
     //tiny_test();
 
     // Initializing of the uniform real distribution for random values
@@ -172,8 +4441,12 @@ int main() {
     int M = 4096;
     int K = 1024;
     int N = 128;
+    if (const Tuning* t = find_tuning(M, K, N)) {
+        std::cout << "Tuned cache blocking for " << M << " x " << K << " x " << N << " (" << tuning_path() << "): mc = "
+                  << t->blocks.mc << ", kc = " << t->blocks.kc << ", nc = " << t->blocks.nc << std::endl;
+    }
 
-    int Nexp = 20, Nexp0 = 20, Nexp1 = 20, Nexp2 = 20, Nexp3 = 20;
+    int Nexp = 20, Nexp0 = 20, Nexp1 = 20, Nexp2 = 20, Nexp3 = 20, Nexp4 = 20, Nexp5 = 20, Nexp6 = 20, Nexp7 = 20;
 
     // Matrix a ~ M x K of random real values
     float *a;
@@ -290,7 +4563,7 @@ int main() {
     for (int i = 0; i < Nexp2; i++) {
         std::chrono::time_point time_12 = std::chrono::system_clock::now();
         // Calculating c2 = aT * b (accelerated variant)
-        multiply_v2_aT(aT, b, c2, M, K, N);
+        multiply_v2_aT(aT, b, c2, M, K, N, 1.0f, 0.0f);
         std::chrono::time_point time_22 = std::chrono::system_clock::now();
 
         // Checking if the functions 'multiply_v0_bT' and 'multiply_v2_aT' result in the same output matrices
@@ -317,7 +4590,7 @@ int main() {
     for (int i = 0; i < Nexp3; i++) {
         std::chrono::time_point time_13 = std::chrono::system_clock::now();
         // Calculating c2 = aT * b (accelerated variant)
-        multiply_v3_aT(aT, b, c3, M, K, N);
+        multiply_v3_aT(aT, b, c3, M, K, N, 1.0f, 0.0f);
         std::chrono::time_point time_23 = std::chrono::system_clock::now();
 
         // Checking if the functions 'multiply_v0_bT' and 'multiply_v2_aT' result in the same output matrices
@@ -334,6 +4607,133 @@ int main() {
     // Printing output results
     std::cout << "Matrix multiplication version 3: " << nanosec3 * 1e-6 << " ms" << std::endl;
 
+    // Matrix c4 ~ M x N
+    float *c4;
+    std::vector<float> vc4(M * N);
+    c4 = vc4.data();
+
+    auto time4 = 0.0;
+    for (int i = 0; i < Nexp4; i++) {
+        std::chrono::time_point time_14 = std::chrono::system_clock::now();
+        // Calculating c4 = aT * b (register-blocked microkernel)
+        multiply_v4_aT(aT, b, c4, M, K, N);
+        std::chrono::time_point time_24 = std::chrono::system_clock::now();
+
+        // Checking if the functions 'multiply_v0_bT' and 'multiply_v4_aT' result in the same output matrices
+        if (!std::equal(vc.begin(), vc.end(), vc4.begin(), vc4.end(), epsilon_equal)) {
+            throw std::runtime_error("vc4 != vc");
+        }
+
+        // Calculation time
+        time4 += std::chrono::duration_cast<std::chrono::nanoseconds>(time_24 - time_14).count();
+    }
+
+    auto nanosec4 = time4 / Nexp4;
+
+    // Printing output results, together with the achieved rate of 2 * M * N * K flops
+    std::cout << "Matrix multiplication version 4: " << nanosec4 * 1e-6 << " ms, "
+              << 2.0 * M * N * K / nanosec4 << " GFLOP/s" << std::endl;
+
+    // Matrix c5 ~ M x N
+    float *c5;
+    std::vector<float> vc5(M * N);
+    c5 = vc5.data();
+
+    auto time5 = 0.0;
+    for (int i = 0; i < Nexp5; i++) {
+        std::chrono::time_point time_15 = std::chrono::system_clock::now();
+        // Calculating c5 = aT * b (five-loop cache blocking around the microkernel)
+        multiply_v5_aT(aT, b, c5, M, K, N, bs);
+        std::chrono::time_point time_25 = std::chrono::system_clock::now();
+
+        // Checking if the functions 'multiply_v0_bT' and 'multiply_v5_aT' result in the same output matrices
+        if (!std::equal(vc.begin(), vc.end(), vc5.begin(), vc5.end(), epsilon_equal)) {
+            throw std::runtime_error("vc5 != vc");
+        }
+
+        // Calculation time
+        time5 += std::chrono::duration_cast<std::chrono::nanoseconds>(time_25 - time_15).count();
+    }
+
+    auto nanosec5 = time5 / Nexp5;
+
+    // Printing output results
+    std::cout << "Matrix multiplication version 5: " << nanosec5 * 1e-6 << " ms, "
+              << 2.0 * M * N * K / nanosec5 << " GFLOP/s" << std::endl;
+
+    // Matrix c6 ~ M x N
+    float *c6;
+    std::vector<float> vc6(M * N);
+    c6 = vc6.data();
+
+    auto time6 = 0.0;
+    for (int i = 0; i < Nexp6; i++) {
+        std::chrono::time_point time_16 = std::chrono::system_clock::now();
+        // Calculating c6 = aT * b (five-loop blocking over packed a and b)
+        multiply_v6_aT(aT, b, c6, M, K, N, bs);
+        std::chrono::time_point time_26 = std::chrono::system_clock::now();
+
+        // Checking if the functions 'multiply_v0_bT' and 'multiply_v6_aT' result in the same output matrices
+        if (!std::equal(vc.begin(), vc.end(), vc6.begin(), vc6.end(), epsilon_equal)) {
+            throw std::runtime_error("vc6 != vc");
+        }
+
+        // Calculation time
+        time6 += std::chrono::duration_cast<std::chrono::nanoseconds>(time_26 - time_16).count();
+    }
+
+    auto nanosec6 = time6 / Nexp6;
+
+    // Printing output results
+    std::cout << "Matrix multiplication version 6: " << nanosec6 * 1e-6 << " ms, "
+              << 2.0 * M * N * K / nanosec6 << " GFLOP/s" << std::endl;
+
+    // Matrix c7 ~ M x N, cache-line aligned so that the tiles of different threads never share a line
+    float *c7;
+    aligned_vector vc7(M * N);
+    c7 = vc7.data();
+
+    auto time7 = 0.0;
+    for (int i = 0; i < Nexp7; i++) {
+        std::chrono::time_point time_17 = std::chrono::system_clock::now();
+        // Calculating c7 = aT * b (multithreaded, work-stealing over macro-tiles of c)
+        multiply_v7_aT(aT, b, c7, M, K, N, bs);
+        std::chrono::time_point time_27 = std::chrono::system_clock::now();
+
+        // Checking if the functions 'multiply_v0_bT' and 'multiply_v7_aT' result in the same output matrices
+        if (!std::equal(vc.begin(), vc.end(), vc7.begin(), vc7.end(), epsilon_equal)) {
+            throw std::runtime_error("vc7 != vc");
+        }
+
+        // Calculation time
+        time7 += std::chrono::duration_cast<std::chrono::nanoseconds>(time_27 - time_17).count();
+    }
+
+    auto nanosec7 = time7 / Nexp7;
+
+    // Printing output results
+    std::cout << "Matrix multiplication version 7 (" << num_threads() << " threads): " << nanosec7 * 1e-6 << " ms, "
+              << 2.0 * M * N * K / nanosec7 << " GFLOP/s" << std::endl;
+
+    bench_tail_latency(aT, b, M, K, N, bs);
+    bench_numa(aT, b, vc, M, K, N, bs);
+    bench_odd_shape(bs);
+    bench_sgemm_layouts(a, aT, b, bT, vc, M, K, N);
+    bench_epilogue(aT, b, M, K, N);
+    bench_batched();
+    bench_fixed_shapes();
+    bench_tiled_variants(aT, b, vc, M, K, N);
+    bench_hgemm(aT, b, M, K, N);
+    bench_bf16(aT, b, M, K, N);
+    bench_qgemm(aT, b, M, K, N);
+    bench_dgemm(aT, b, vc, M, K, N);
+    bench_strassen(2048);
+    bench_spmm(M, K, N);
+    bench_2_4(aT, b, M, K, N);
+    bench_sddmm(4096, 128, 4096);
+    bench_gemv(4096, 8192);
+    bench_split_k(64, 262144, 64);
+
     return 0;
 
 //    AVX-512 is defined